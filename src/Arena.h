@@ -0,0 +1,92 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+/*
+    Bump allocator for short-lived buffers, like the samples of a waveform being encoded.
+    Allocations are carved out of large blocks, aligned for SIMD loads and stores, and never freed
+    one by one: reset() releases all of them at once and keeps the blocks for the next use, so
+    a thread that builds the same kind of buffers over and over stops allocating after the first time.
+    An arena belongs to one thread.
+*/
+
+class Arena {
+public:
+    // Alignment of every allocation, enough for SSE and AVX loads
+    static const size_t ALIGNMENT = 32;
+
+    explicit Arena(size_t blockSize = 1 << 16) : blockSize(blockSize) {
+    }
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    // Uninitialized room for `count` values of T, aligned to ALIGNMENT, valid until reset().
+    template <typename T>
+    T* allocate(size_t count) {
+        static_assert(std::is_trivially_destructible<T>::value, "Arena allocations are never destroyed");
+        return (T*)allocateBytes(count * sizeof(T));
+    }
+
+    void* allocateBytes(size_t size) {
+        size = (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+        if (current >= blocks.size() || used + size > blocks[current].size) {
+            nextBlock(size);
+        }
+        void* memory = blocks[current].start + used;
+        used += size;
+        allocated += size;
+        return memory;
+    }
+
+    // Release every allocation, keeping the blocks.
+    void reset() {
+        current = 0;
+        used = 0;
+        allocated = 0;
+    }
+
+    // Bytes handed out since the last reset, and bytes held in blocks.
+    size_t bytesAllocated() const {
+        return allocated;
+    }
+
+    size_t bytesReserved() const {
+        size_t total = 0;
+        for (size_t i = 0; i < blocks.size(); i++) {
+            total += blocks[i].size;
+        }
+        return total;
+    }
+
+private:
+    struct Block {
+        std::unique_ptr<char[]> memory;
+        char* start; // memory rounded up to ALIGNMENT
+        size_t size;
+    };
+
+    // Move on to the block after the current one, inserting a new one there if it cannot hold `size` bytes.
+    void nextBlock(size_t size) {
+        size_t next = blocks.empty() ? 0 : current + 1;
+        if (next >= blocks.size() || blocks[next].size < size) {
+            Block block;
+            block.size = size > blockSize ? size : blockSize;
+            block.memory.reset(new char[block.size + ALIGNMENT]);
+            block.start = (char*)(((uintptr_t)block.memory.get() + ALIGNMENT - 1) & ~(uintptr_t)(ALIGNMENT - 1));
+            blocks.insert(blocks.begin() + next, std::move(block));
+        }
+        current = next;
+        used = 0;
+    }
+
+    size_t blockSize;
+    std::vector<Block> blocks;
+    size_t current = 0; // block the allocations come from
+    size_t used = 0;    // bytes of the current block handed out
+    size_t allocated = 0;
+};
@@ -0,0 +1,205 @@
+#pragma once
+
+#include <stdio.h>
+#include <math.h>
+#include <chrono>
+#include <string>
+
+/*
+    Protection of the coils against overheating and fast current changes.
+    The heat of a coil is tracked with a first-order I^2 t model: the mean square current, low-pass
+    filtered with the thermal time constant of the coil. At a constant current I it settles at I^2,
+    so the coil may carry its rated current forever, and more than that for a while when it was cool.
+    Every set-point is clamped so the model stays below the rated current squared for `horizon`
+    seconds, and so the current changes by at most slewRate amps per second since the last set-point.
+    A set-point may be held far longer than that, so tick() checks it again while it is held and lowers
+    it before the heat reaches the rated current; held long enough, it settles at the rated current.
+    Lists are scaled as a whole, keeping their shape, by their mean square, peak and steepest step.
+    Each update costs a constant amount of work; only the scan of a new list is linear in its length.
+*/
+
+struct CoilLimits {
+    float ratedCurrent = 0;  // largest continuous current in amps; 0 disables the thermal model
+    float peakCurrent = 0;   // largest current at any time; 0 for no limit
+    float timeConstant = 60; // thermal time constant of the coil in seconds
+    float slewRate = 0;      // largest change of the current in amps per second; 0 for no limit
+    float horizon = 1;       // seconds a set-point must be safe to hold
+};
+
+struct CoilLimiterStats {
+    int setpointsClamped = 0;
+    int listsScaled = 0;
+    float smallestListScale = 1;
+    double maxHeat = 0; // largest heat as a fraction of the rated current squared
+};
+
+class CoilLimiter {
+public:
+    CoilLimits limits;
+    CoilLimiterStats stats;
+    double timeScale = 1; // a replay runs the coil model this many times faster than the clock
+
+    // Limit a set-point that is applied now; it then flows until the next update.
+    float limitSetpoint(float current) {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        double dt = advance(now);
+        float limited = current;
+        float bound = allowedCurrent(limits.horizon);
+        if (fabs(limited) > bound) {
+            limited = limited > 0 ? bound : -bound;
+        }
+        slewLimited = false;
+        if (limits.slewRate > 0 && started) {
+            float step = (float)(limits.slewRate * dt);
+            if (limited > lastCurrent + step) {
+                limited = lastCurrent + step;
+                slewLimited = true;
+            }
+            else if (limited < lastCurrent - step) {
+                limited = lastCurrent - step;
+                slewLimited = true;
+            }
+        }
+        if (limited != current) {
+            stats.setpointsClamped++;
+        }
+        lastCurrent = limited;
+        square = limited * limited;
+        started = true;
+        holding = true;
+        return limited;
+    }
+
+    // Check the held set-point again. Returns true and the set-point to apply now in `current` if holding it
+    // for another `horizon` seconds would take the heat past the rated current. It is lowered to what is safe
+    // for twice the horizon, so a held set-point is lowered about once per horizon, not on every call.
+    // Lists are accounted for as a whole when they start, and never need it.
+    bool tick(float* current) {
+        if (!holding || limits.ratedCurrent <= 0) {
+            return false;
+        }
+        advance(std::chrono::steady_clock::now());
+        if (fabs(lastCurrent) <= allowedCurrent(limits.horizon)) {
+            return false;
+        }
+        float bound = allowedCurrent(2 * limits.horizon);
+        lastCurrent = lastCurrent > 0 ? bound : -bound;
+        square = lastCurrent * lastCurrent;
+        stats.setpointsClamped++;
+        *current = lastCurrent;
+        return true;
+    }
+
+    // Factor (at most 1) to scale a list by so it is safe to play `count` times, or forever if count is 0.
+    // meanSquare is set to the mean square of the scaled list, to be passed to startList().
+    float listScale(const float* values, int length, float dwell, int count, double* meanSquare) {
+        *meanSquare = 0;
+        if (length <= 0) {
+            return 1;
+        }
+        advance(std::chrono::steady_clock::now());
+        double sumSquares = 0;
+        float largest = 0;
+        float steepest = 0;
+        for (int i = 0; i < length; i++) {
+            sumSquares += values[i] * values[i];
+            largest = fabs(values[i]) > largest ? fabs(values[i]) : largest;
+            // A repeated list also steps from its last value back to its first
+            if (i > 0 || count != 1) {
+                float step = fabs(values[i] - values[(i + length - 1) % length]);
+                steepest = step > steepest ? step : steepest;
+            }
+        }
+        double listSquare = sumSquares / length;
+        float scale = 1;
+        if (limits.peakCurrent > 0 && largest > limits.peakCurrent) {
+            scale = limits.peakCurrent / largest;
+        }
+        if (limits.ratedCurrent > 0 && listSquare > 0) {
+            // A list played forever must stay at the rated current; a finite one only for its duration
+            float allowed = count == 0 ? limits.ratedCurrent : allowedCurrent((float)(length * dwell * count));
+            float thermal = (float)(allowed / sqrt(listSquare));
+            scale = thermal < scale ? thermal : scale;
+        }
+        if (limits.slewRate > 0 && steepest > 0 && dwell > 0 && steepest / dwell > limits.slewRate) {
+            float slew = limits.slewRate * dwell / steepest;
+            scale = slew < scale ? slew : scale;
+        }
+        if (scale < 1) {
+            stats.listsScaled++;
+            stats.smallestListScale = scale < stats.smallestListScale ? scale : stats.smallestListScale;
+        }
+        *meanSquare = listSquare * scale * scale;
+        return scale;
+    }
+
+    // A list with the given mean square and first value starts playing now.
+    void startList(double meanSquare, float first) {
+        advance(std::chrono::steady_clock::now());
+        square = meanSquare;
+        lastCurrent = first;
+        started = true;
+        holding = false;
+    }
+
+    // The output is off now.
+    void stop() {
+        advance(std::chrono::steady_clock::now());
+        square = 0;
+        lastCurrent = 0;
+        started = true;
+        holding = false;
+    }
+
+    void report(const std::string& name) const {
+        if (limits.ratedCurrent <= 0 && limits.peakCurrent <= 0 && limits.slewRate <= 0) {
+            return;
+        }
+        printf("%s coil: heat %.0f %% of rated (max %.0f %%), %d set-points clamped, %d lists scaled (smallest %.3f)\n",
+            name.c_str(), heatFraction() * 100, stats.maxHeat * 100, stats.setpointsClamped, stats.listsScaled,
+            stats.smallestListScale);
+    }
+
+    // Was the last set-point cut short by the slew rate? Sending it again later gets closer to it.
+    bool slewing() const {
+        return slewLimited;
+    }
+
+    double heatFraction() const {
+        return limits.ratedCurrent > 0 ? heat / (limits.ratedCurrent * limits.ratedCurrent) : 0;
+    }
+
+private:
+    // Let the current that flowed since the last update heat the coil. Returns the elapsed seconds.
+    double advance(std::chrono::steady_clock::time_point now) {
+        double dt = started ? std::chrono::duration<double>(now - lastUpdate).count() * timeScale : 0;
+        lastUpdate = now;
+        if (limits.timeConstant > 0) {
+            heat = square + (heat - square) * exp(-dt / limits.timeConstant);
+        }
+        double fraction = heatFraction();
+        stats.maxHeat = fraction > stats.maxHeat ? fraction : stats.maxHeat;
+        return dt;
+    }
+
+    // Largest current that keeps the heat below the rated current squared for `seconds`, and below the peak.
+    float allowedCurrent(float seconds) const {
+        float allowed = limits.peakCurrent > 0 ? limits.peakCurrent : INFINITY;
+        if (limits.ratedCurrent <= 0 || limits.timeConstant <= 0) {
+            return allowed;
+        }
+        double rated = (double)limits.ratedCurrent * limits.ratedCurrent;
+        double decay = exp(-seconds / limits.timeConstant);
+        double bound = decay < 1 ? (rated - heat * decay) / (1 - decay) : rated;
+        float thermal = bound > 0 ? (float)sqrt(bound) : 0;
+        return thermal < allowed ? thermal : allowed;
+    }
+
+    bool started = false;
+    bool holding = false; // a set-point, not a list, is flowing
+    bool slewLimited = false;
+    std::chrono::steady_clock::time_point lastUpdate;
+    double heat = 0;    // filtered mean square current
+    double square = 0;  // square of the current flowing since lastUpdate
+    float lastCurrent = 0;
+};
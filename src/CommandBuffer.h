@@ -0,0 +1,195 @@
+#pragma once
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <mutex>
+#include "Arena.h"
+
+/*
+    Commands for the power supplies, formatted into buffers of their own instead of one shared array
+    per power supply. A CommandBuffer is written once by CommandBuffer::format() and never changed
+    after that; it is moved, not copied, from the code building a command to the one sending it, and
+    the write passes its text straight to viWrite. So a command can be built on one thread while
+    another one is being written, and nothing has to be cleared after a write.
+    The buffers are fixed-size blocks recycled by CommandPool: a thread takes blocks from a small
+    cache of its own and gives them back there, so building and sending a command takes no lock and
+    allocates nothing once the pool is warm. Blocks beyond the cache, and the cache of a finished thread,
+    go to a shared list for the next thread that needs them; the shared list grows out of an Arena.
+    The commands uploading a list are not CommandBuffers: a PreparedList (see ListEncoding.h) is encoded
+    once, off the I/O threads, and then sent many times, e.g. from the cache of a sweep, again after a
+    reconnect, or to replay the shadow state, so its commands are shared read-only strings instead of
+    buffers given up by the first write.
+*/
+
+// Longest command a buffer holds, including the terminating zero
+#define COMMAND_CAPACITY 512
+
+struct CommandBlock {
+    CommandBlock* next; // while free
+    size_t length;
+    char text[COMMAND_CAPACITY];
+};
+
+class CommandPool {
+public:
+    // Free blocks a thread keeps for itself
+    static const int THREAD_CACHE = 8;
+
+    // The pool shared by the whole process.
+    static CommandPool& instance() {
+        static CommandPool pool;
+        return pool;
+    }
+
+    // A block for a new command, from the cache of the calling thread if it has one.
+    CommandBlock* take() {
+        ThreadCache& cache = threadCache();
+        if (cache.head == NULL) {
+            refill(&cache);
+        }
+        CommandBlock* block = cache.head;
+        cache.head = block->next;
+        cache.count--;
+        return block;
+    }
+
+    // Give back a block, to the cache of the calling thread unless it is full.
+    void give(CommandBlock* block) {
+        ThreadCache& cache = threadCache();
+        if (cache.count >= THREAD_CACHE) {
+            std::lock_guard<std::mutex> guard(lock);
+            block->next = shared;
+            shared = block;
+            return;
+        }
+        block->next = cache.head;
+        cache.head = block;
+        cache.count++;
+    }
+
+    // Blocks ever carved out of the arena; stays flat once every thread has its cache.
+    size_t blocks() {
+        std::lock_guard<std::mutex> guard(lock);
+        return created;
+    }
+
+private:
+    struct ThreadCache {
+        CommandBlock* head = NULL;
+        int count = 0;
+
+        // A finished thread leaves its blocks to the others.
+        ~ThreadCache() {
+            CommandPool::instance().giveAll(head);
+        }
+    };
+
+    CommandPool() : arena(THREAD_CACHE * sizeof(CommandBlock) * 4) {
+    }
+
+    ThreadCache& threadCache() {
+        static thread_local ThreadCache cache;
+        return cache;
+    }
+
+    // Move half a cache worth of blocks to `cache`, from the shared list or else the arena.
+    void refill(ThreadCache* cache) {
+        std::lock_guard<std::mutex> guard(lock);
+        for (int i = 0; i < THREAD_CACHE / 2; i++) {
+            CommandBlock* block = shared;
+            if (block != NULL) {
+                shared = block->next;
+            }
+            else {
+                block = arena.allocate<CommandBlock>(1);
+                created++;
+            }
+            block->next = cache->head;
+            cache->head = block;
+            cache->count++;
+        }
+    }
+
+    void giveAll(CommandBlock* head) {
+        std::lock_guard<std::mutex> guard(lock);
+        while (head != NULL) {
+            CommandBlock* next = head->next;
+            head->next = shared;
+            shared = head;
+            head = next;
+        }
+    }
+
+    std::mutex lock;
+    Arena arena;           // never reset: blocks are recycled through the free lists
+    CommandBlock* shared = NULL;
+    size_t created = 0;
+};
+
+class CommandBuffer {
+public:
+    CommandBuffer() {
+    }
+
+    // A command formatted like printf. A command longer than COMMAND_CAPACITY - 1 characters is never
+    // sent cut off: the buffer is empty instead, and PowerSupply::executeCommand() refuses it.
+    static CommandBuffer format(const char* format, ...) {
+        CommandBuffer command;
+        command.block = CommandPool::instance().take();
+        va_list arguments;
+        va_start(arguments, format);
+        int length = vsnprintf(command.block->text, COMMAND_CAPACITY, format, arguments);
+        va_end(arguments);
+        if (length <= 0 || length >= COMMAND_CAPACITY) {
+            command.clear();
+            return command;
+        }
+        command.block->length = length;
+        return command;
+    }
+
+    CommandBuffer(CommandBuffer&& other) : block(other.block) {
+        other.block = NULL;
+    }
+
+    CommandBuffer& operator=(CommandBuffer&& other) {
+        if (this != &other) {
+            clear();
+            block = other.block;
+            other.block = NULL;
+        }
+        return *this;
+    }
+
+    CommandBuffer(const CommandBuffer&) = delete;
+    CommandBuffer& operator=(const CommandBuffer&) = delete;
+
+    ~CommandBuffer() {
+        clear();
+    }
+
+    // The text of the command, zero-terminated; empty if there is none.
+    const char* data() const {
+        return block != NULL ? block->text : "";
+    }
+
+    size_t size() const {
+        return block != NULL ? block->length : 0;
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    // Give the buffer back to the pool.
+    void clear() {
+        if (block != NULL) {
+            CommandPool::instance().give(block);
+            block = NULL;
+        }
+    }
+
+private:
+    CommandBlock* block = NULL;
+};
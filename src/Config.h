@@ -0,0 +1,534 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+#include "CoilLimiter.h"
+#include "Platform.h"
+
+/*
+    Settings of the magnet system, from a configuration file and the command line.
+    The file (magnets.cfg unless --config <path> is given) has one "<key> <value>" pair per line;
+    empty lines and lines starting with '#' are ignored. A line "[name]" starts a preset: a named
+    set of values applied over the ones before the first preset when "preset <name>" selects it.
+    Any key can be overridden on the command line with "--<key> <value>", or "--<key>" for flags.
+    Command-line values win over the file and its preset.
+    The file can be reloaded while running (see ConfigLoader::changed()); everything but the ports
+    takes effect without reconnecting the power supplies.
+*/
+
+// Default of the "steps" setting: samples per turn of the rotation and hopping waveforms.
+#define NUM_STEPS 48
+
+// Saved setups of the power supplies (*sav and *rcl) the waveforms may be stored in, and how many they
+// take: two banks of the four hopping directions and the rotation.
+#define MAX_LIST_SLOTS 16
+#define WAVEFORM_SLOTS 10
+
+// Waveform shapes of a sweep: the hopping directions in the order of their LUT offsets, then the rotation.
+const char* const SWEEP_SHAPES[] = { "hop-right", "hop-up", "hop-left", "hop-down", "rotation" };
+const int SWEEP_ROTATION = 4;
+
+// Parse "a,b,c" or "first:last:step" into `values`. Returns false if the text is neither.
+inline bool parseValueList(const std::string& text, std::vector<float>* values) {
+    values->clear();
+    float first, last, step;
+    char extra;
+    if (sscanf(text.c_str(), "%f:%f:%f%c", &first, &last, &step, &extra) == 3) {
+        if (step <= 0 || last < first) {
+            return false;
+        }
+        // Half a step of tolerance so the last value is not lost to rounding
+        for (int i = 0; first + i * step <= last + step / 2; i++) {
+            values->push_back(first + i * step);
+        }
+        return true;
+    }
+    std::stringstream items(text);
+    std::string item;
+    while (std::getline(items, item, ',')) {
+        char* end = NULL;
+        values->push_back((float)strtod(item.c_str(), &end));
+        if (end == item.c_str() || *end != '\0') {
+            return false;
+        }
+    }
+    return !values->empty();
+}
+
+typedef std::vector<std::pair<std::string, std::string> > Settings;
+
+struct Config {
+    // Waveforms
+    float freq = 1;          // Hz, of the rotation and the hopping motion
+    float zCurrent = 0;      // amps
+    float xyCurrent = 0;     // amps
+    float voltageLimit = 20; // volts
+    int steps = NUM_STEPS;   // samples per turn, a multiple of 4
+    bool currentsSet = false; // were any of the currents above or of a sweep given?
+
+    // Timing
+    double skewMs = 57;          // delay of the X and Z starts behind Y, whose supply is slower
+    double readbackInterval = 0; // seconds between readbacks of the output currents; 0 for none
+    double statsInterval = 0;    // seconds between dumps of the I/O statistics to the log; 0 for none
+    int metricsPort = 0;         // port of the metrics endpoint on 127.0.0.1; 0 for none (see Metrics.h)
+
+    // Ports of the X, Y and Z supplies, replaced by the matches of the axis map if discover is set
+    std::string ports[3] = { "ASRL3::INSTR", "ASRL4::INSTR", "ASRL5::INSTR" };
+    std::string axisMap = "axes.cfg";
+    bool discover = true;
+    bool simulate = false; // simulated power supplies instead of the instruments
+
+    // Saved setups the waveforms are stored in, replacing whatever the operator saved there: WAVEFORM_SLOTS
+    // slots from listSlots[0]. Off (0) unless "list-slots <first>,<last>" is given; lists are then uploaded
+    // on demand.
+    int listSlots[2] = { 0, 0 };
+
+    // Resolution of the DAC of the X, Y and Z supplies in bits, which sets the decimals of the compact
+    // list encoding and the default verifyTolerance. Read when the supplies connect.
+    int dacBits[3] = { 12, 12, 12 };
+
+    // Read back every uploaded list and compare it within verifyTolerance amps (0 for one DAC step)
+    bool verifyLists = false;
+    float verifyTolerance = 0;
+
+    CoilLimits coilLimits;
+
+    // Real-time scheduling, cores of the threads and memory locking (see Platform.h)
+    PlatformSettings platform;
+    // Microseconds spun before each deadline instead of sleeping, -1 to calibrate at startup (see Timing.h)
+    double spinMarginUs = -1;
+
+    // Steering of the xy field with the left stick: "linear" scales x and y independently,
+    // "polar" keeps the magnitude and sends at most joystickRate set-points per second (see Joystick.h)
+    bool polarJoystick = false;
+    double joystickRate = 50;
+
+    // Modes: the control server on a port, or position control from a tracker
+    int serve = 0;
+    std::string track;
+    float target[3] = { 0, 0, 0 };
+    float gains[3] = { 1, 0, 0 };
+    double controlRate = 100;
+
+    // Sweep over every combination of the listed values, each held for sweepDwell seconds (see Sweep.h).
+    // An empty list sweeps only the single value of the setting above.
+    bool sweep = false;
+    std::vector<float> sweepFreqs;
+    std::vector<float> sweepZCurrents;
+    std::vector<float> sweepXyCurrents;
+    std::vector<int> sweepShapes; // indices into SWEEP_SHAPES; empty for hop-right
+    double sweepDwell = 10;
+    int sweepRepeat = 1;          // passes over the grid
+    std::string sweepLog = "sweep.csv";
+
+    // Set `key` to `value`. Returns false with a message in `error` if the key is unknown
+    // or the value is invalid.
+    bool set(const std::string& key, const std::string& value, std::string* error) {
+        const char* text = value.c_str();
+        char* end = NULL;
+        double number = strtod(text, &end);
+        bool isNumber = end != text && *end == '\0';
+        if (key == "freq" || key == "z-current" || key == "xy-current" || key == "voltage-limit" || key == "steps"
+            || key == "skew-ms" || key == "readback-interval" || key == "stats-interval" || key == "metrics-port" || key == "rated-current"
+            || key == "peak-current" || key == "time-constant" || key == "slew-rate" || key == "serve" || key == "control-rate"
+            || key == "sweep-dwell" || key == "sweep-repeat" || key == "joystick-rate" || key == "verify-tolerance"
+            || key == "cpu-input" || key == "cpu-planning" || key == "spin-margin-us") {
+            if (!isNumber) {
+                *error = key + " needs a number, not \"" + value + "\"";
+                return false;
+            }
+        }
+        if (key == "freq") {
+            if (number <= 0) {
+                *error = "freq must be positive";
+                return false;
+            }
+            freq = (float)number;
+        }
+        else if (key == "z-current") {
+            zCurrent = (float)number;
+            currentsSet = true;
+        }
+        else if (key == "xy-current") {
+            xyCurrent = (float)number;
+            currentsSet = true;
+        }
+        else if (key == "voltage-limit") {
+            voltageLimit = (float)number;
+        }
+        else if (key == "steps") {
+            // The hopping list has 2 * steps points and must fit the list memory
+            if (number < 4 || (int)number % 4 != 0 || number > 500) {
+                *error = "steps must be a multiple of 4 from 4 to 500";
+                return false;
+            }
+            steps = (int)number;
+        }
+        else if (key == "skew-ms") {
+            skewMs = number;
+        }
+        else if (key == "readback-interval") {
+            readbackInterval = number;
+        }
+        else if (key == "stats-interval") {
+            statsInterval = number;
+        }
+        else if (key == "metrics-port") {
+            metricsPort = (int)number;
+        }
+        else if (key == "port-x" || key == "port-y" || key == "port-z") {
+            ports[key[5] - 'x'] = value;
+        }
+        else if (key == "axis-map") {
+            axisMap = value;
+        }
+        else if (key == "list-slots") {
+            int first, last;
+            if (value == "0" || value == "off" || value == "no") {
+                listSlots[0] = listSlots[1] = 0;
+            }
+            else if (sscanf(text, "%d,%d", &first, &last) != 2 || first < 1 || last > MAX_LIST_SLOTS
+                || last - first + 1 < WAVEFORM_SLOTS) {
+                *error = "list-slots needs first,last: at least " + std::to_string(WAVEFORM_SLOTS)
+                    + " slots from 1 to " + std::to_string(MAX_LIST_SLOTS) + ", or off";
+                return false;
+            }
+            else {
+                listSlots[0] = first;
+                listSlots[1] = last;
+            }
+        }
+        else if (key == "discover" || key == "simulate" || key == "sweep" || key == "verify-lists" || key == "realtime"
+            || key == "lock-memory") {
+            bool flag = value == "1" || value == "true" || value == "yes" || value == "on";
+            if (!flag && value != "0" && value != "false" && value != "no" && value != "off") {
+                *error = key + " needs yes or no, not \"" + value + "\"";
+                return false;
+            }
+            bool* flags[6] = { &discover, &simulate, &sweep, &verifyLists, &platform.realtime, &platform.lockMemory };
+            const char* names[6] = { "discover", "simulate", "sweep", "verify-lists", "realtime", "lock-memory" };
+            for (int i = 0; i < 6; i++) {
+                if (key == names[i]) {
+                    *flags[i] = flag;
+                }
+            }
+        }
+        else if (key == "cpu-input" || key == "cpu-planning") {
+            (key == "cpu-input" ? platform.inputCore : platform.planningCore) = (int)number;
+        }
+        else if (key == "dac-bits") {
+            // Bits of the X, Y and Z supplies, or one resolution for all three
+            int bits[3];
+            int read = sscanf(text, "%d,%d,%d", &bits[0], &bits[1], &bits[2]);
+            if (read == 1) {
+                bits[1] = bits[2] = bits[0];
+            }
+            for (int i = 0; i < 3 && (read == 1 || read == 3); i++) {
+                if (bits[i] < 8 || bits[i] > 24) {
+                    read = 0;
+                }
+            }
+            if (read != 1 && read != 3) {
+                *error = "dac-bits needs one or three comma-separated resolutions from 8 to 24 bits";
+                return false;
+            }
+            memcpy(dacBits, bits, sizeof(dacBits));
+        }
+        else if (key == "cpu-io") {
+            // Cores of the X, Y and Z I/O threads, or one core for all three
+            int* cores = platform.ioCores;
+            int read = sscanf(text, "%d,%d,%d", &cores[0], &cores[1], &cores[2]);
+            if (read == 1) {
+                cores[1] = cores[2] = cores[0];
+            }
+            else if (read != 3) {
+                *error = "cpu-io needs one core or three comma-separated cores";
+                return false;
+            }
+        }
+        else if (key == "spin-margin-us") {
+            spinMarginUs = number;
+        }
+        else if (key == "verify-tolerance") {
+            verifyTolerance = (float)number;
+        }
+        else if (key == "rated-current") {
+            coilLimits.ratedCurrent = (float)number;
+        }
+        else if (key == "peak-current") {
+            coilLimits.peakCurrent = (float)number;
+        }
+        else if (key == "time-constant") {
+            coilLimits.timeConstant = (float)number;
+        }
+        else if (key == "slew-rate") {
+            coilLimits.slewRate = (float)number;
+        }
+        else if (key == "coil-limits") {
+            // rated,peak,time constant,slew rate in one value
+            if (sscanf(text, "%f,%f,%f,%f", &coilLimits.ratedCurrent, &coilLimits.peakCurrent,
+                &coilLimits.timeConstant, &coilLimits.slewRate) < 1) {
+                *error = "coil-limits needs rated,peak,time constant,slew rate";
+                return false;
+            }
+        }
+        else if (key == "joystick") {
+            if (value != "linear" && value != "polar") {
+                *error = "joystick needs linear or polar, not \"" + value + "\"";
+                return false;
+            }
+            polarJoystick = value == "polar";
+        }
+        else if (key == "joystick-rate") {
+            if (number <= 0) {
+                *error = "joystick-rate must be positive";
+                return false;
+            }
+            joystickRate = number;
+        }
+        else if (key == "serve") {
+            serve = (int)number;
+        }
+        else if (key == "track") {
+            track = value;
+        }
+        else if (key == "target" || key == "gains") {
+            float* values = key == "target" ? target : gains;
+            if (sscanf(text, "%f,%f,%f", &values[0], &values[1], &values[2]) != 3) {
+                *error = key + " needs three comma-separated numbers";
+                return false;
+            }
+        }
+        else if (key == "control-rate") {
+            if (number <= 0) {
+                *error = "control-rate must be positive";
+                return false;
+            }
+            controlRate = number;
+        }
+        else if (key == "sweep-freq" || key == "sweep-z-current" || key == "sweep-xy-current") {
+            std::vector<float>& values = key == "sweep-freq" ? sweepFreqs : (key == "sweep-z-current" ? sweepZCurrents : sweepXyCurrents);
+            if (!parseValueList(value, &values)) {
+                *error = key + " needs a,b,c or first:last:step";
+                return false;
+            }
+            for (size_t i = 0; key == "sweep-freq" && i < values.size(); i++) {
+                if (values[i] <= 0) {
+                    *error = "sweep-freq must be positive";
+                    return false;
+                }
+            }
+            currentsSet = currentsSet || key != "sweep-freq";
+        }
+        else if (key == "sweep-shape") {
+            sweepShapes.clear();
+            std::stringstream names(value);
+            std::string name;
+            while (std::getline(names, name, ',')) {
+                int shape = 0;
+                while (shape <= SWEEP_ROTATION && name != SWEEP_SHAPES[shape]) {
+                    shape++;
+                }
+                if (shape > SWEEP_ROTATION) {
+                    *error = "unknown sweep shape " + name + ", use hop-right, hop-up, hop-left, hop-down or rotation";
+                    return false;
+                }
+                sweepShapes.push_back(shape);
+            }
+        }
+        else if (key == "sweep-dwell") {
+            if (number <= 0) {
+                *error = "sweep-dwell must be positive";
+                return false;
+            }
+            sweepDwell = number;
+        }
+        else if (key == "sweep-repeat") {
+            if (number < 1) {
+                *error = "sweep-repeat must be at least 1";
+                return false;
+            }
+            sweepRepeat = (int)number;
+        }
+        else if (key == "sweep-log") {
+            sweepLog = value;
+        }
+        else {
+            *error = "unknown setting " + key;
+            return false;
+        }
+        return true;
+    }
+
+    // Can the magnet system change from `other` to this configuration without reconnecting?
+    bool samePorts(const Config& other) const {
+        return ports[0] == other.ports[0] && ports[1] == other.ports[1] && ports[2] == other.ports[2]
+            && axisMap == other.axisMap && discover == other.discover && simulate == other.simulate
+            && listSlots[0] == other.listSlots[0] && listSlots[1] == other.listSlots[1]
+            && dacBits[0] == other.dacBits[0] && dacBits[1] == other.dacBits[1] && dacBits[2] == other.dacBits[2];
+    }
+
+    // The settings that decide which commands the control loop sends, as keys and values set() takes
+    // back: the waveforms, timing, readbacks and list checks, joystick, coil limits, DAC and list slots.
+    // A replay applies them to take the same path as the recorded session (see Replay.h).
+    Settings controlSettings() const {
+        char text[96];
+        Settings settings;
+        sprintf(text, "%.9g", freq);
+        settings.push_back(std::make_pair("freq", text));
+        sprintf(text, "%.9g", zCurrent);
+        settings.push_back(std::make_pair("z-current", text));
+        sprintf(text, "%.9g", xyCurrent);
+        settings.push_back(std::make_pair("xy-current", text));
+        sprintf(text, "%.9g", voltageLimit);
+        settings.push_back(std::make_pair("voltage-limit", text));
+        settings.push_back(std::make_pair("steps", std::to_string(steps)));
+        sprintf(text, "%.17g", skewMs);
+        settings.push_back(std::make_pair("skew-ms", text));
+        sprintf(text, "%.17g", readbackInterval);
+        settings.push_back(std::make_pair("readback-interval", text));
+        settings.push_back(std::make_pair("verify-lists", verifyLists ? "yes" : "no"));
+        sprintf(text, "%.9g", verifyTolerance);
+        settings.push_back(std::make_pair("verify-tolerance", text));
+        settings.push_back(std::make_pair("joystick", polarJoystick ? "polar" : "linear"));
+        sprintf(text, "%.17g", joystickRate);
+        settings.push_back(std::make_pair("joystick-rate", text));
+        sprintf(text, "%.9g,%.9g,%.9g,%.9g", coilLimits.ratedCurrent, coilLimits.peakCurrent, coilLimits.timeConstant,
+            coilLimits.slewRate);
+        settings.push_back(std::make_pair("coil-limits", text));
+        sprintf(text, "%d,%d,%d", dacBits[0], dacBits[1], dacBits[2]);
+        settings.push_back(std::make_pair("dac-bits", text));
+        sprintf(text, "%d,%d", listSlots[0], listSlots[1]);
+        settings.push_back(std::make_pair("list-slots", listSlots[0] > 0 ? text : "off"));
+        return settings;
+    }
+
+    // Are the waveforms the same as the ones of `other`?
+    bool sameWaveforms(const Config& other) const {
+        return freq == other.freq && zCurrent == other.zCurrent && xyCurrent == other.xyCurrent
+            && voltageLimit == other.voltageLimit && steps == other.steps;
+    }
+};
+
+// Reads the configuration file and applies the command-line overrides.
+class ConfigLoader {
+public:
+    std::string path = "magnets.cfg";
+    Settings overrides;
+
+    // Take --config <path> and every "--<key> [value]" of the command line. The keys are checked by load().
+    void parseArguments(int argc, char* argv[]) {
+        for (int i = 1; i < argc; i++) {
+            if (strncmp(argv[i], "--", 2) != 0) {
+                continue;
+            }
+            std::string key = argv[i] + 2;
+            std::string value = "1";
+            if (i + 1 < argc && strncmp(argv[i + 1], "--", 2) != 0) {
+                value = argv[++i];
+            }
+            if (key == "config") {
+                path = value;
+            }
+            else {
+                overrides.push_back(std::make_pair(key, value));
+            }
+        }
+    }
+
+    // Build the configuration from the defaults, the file, its selected preset and the overrides.
+    // A missing file leaves the defaults, with a message, except on a reload, which keeps the settings
+    // running. Returns false, leaving `config` unchanged, if a setting is invalid.
+    bool load(Config* config, bool reload = false) {
+        Settings base;
+        std::map<std::string, Settings> presets;
+        modified = modificationTime();
+        std::ifstream file(path.c_str());
+        if (!file.is_open()) {
+            std::cout << "Cannot read " << path << (reload ? ", keeping the current settings" : ", using the defaults")
+                << "\n\n";
+            if (reload) {
+                return false;
+            }
+        }
+        std::string line;
+        Settings* section = &base;
+        int number = 0;
+        while (std::getline(file, line)) {
+            number++;
+            std::stringstream fields(line);
+            std::string key;
+            if (!(fields >> key) || key[0] == '#') {
+                continue;
+            }
+            if (key[0] == '[') {
+                section = &presets[key.substr(1, key.find(']') - 1)];
+                continue;
+            }
+            std::string value;
+            std::getline(fields >> std::ws, value);
+            while (!value.empty() && (value.back() == '\r' || value.back() == ' ')) {
+                value.pop_back();
+            }
+            section->push_back(std::make_pair(key, value));
+        }
+
+        std::string preset;
+        for (size_t i = 0; i < base.size(); i++) {
+            preset = base[i].first == "preset" ? base[i].second : preset;
+        }
+        for (size_t i = 0; i < overrides.size(); i++) {
+            preset = overrides[i].first == "preset" ? overrides[i].second : preset;
+        }
+        if (!preset.empty() && presets.find(preset) == presets.end()) {
+            std::cout << "No preset " << preset << " in " << path << "\n\n";
+            return false;
+        }
+
+        Config loaded;
+        std::string error;
+        const Settings* layers[3] = { &base, preset.empty() ? NULL : &presets[preset], &overrides };
+        for (int layer = 0; layer < 3; layer++) {
+            for (size_t i = 0; layers[layer] != NULL && i < layers[layer]->size(); i++) {
+                const std::pair<std::string, std::string>& setting = (*layers[layer])[i];
+                if (setting.first != "preset" && !loaded.set(setting.first, setting.second, &error)) {
+                    std::cout << (layer == 2 ? std::string("Command line") : path) << ": " << error << "\n\n";
+                    return false;
+                }
+            }
+        }
+        *config = loaded;
+        this->preset = preset;
+        return true;
+    }
+
+    // Has the file changed since it was loaded?
+    bool changed() const {
+        return modificationTime() != modified;
+    }
+
+    // Preset selected by the last load, or empty.
+    std::string preset;
+
+private:
+    // Time and size of the last change, since the time alone only has a resolution of seconds
+    std::pair<time_t, long long> modificationTime() const {
+        struct stat info;
+        if (stat(path.c_str(), &info) != 0) {
+            return std::make_pair((time_t)0, -1LL);
+        }
+        return std::make_pair(info.st_mtime, (long long)info.st_size);
+    }
+
+    std::pair<time_t, long long> modified;
+};
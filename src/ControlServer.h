@@ -0,0 +1,579 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+#include <iostream>
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "Ws2_32.lib")
+typedef SOCKET SocketHandle;
+#define INVALID_SOCKET_HANDLE INVALID_SOCKET
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+typedef int SocketHandle;
+#define INVALID_SOCKET_HANDLE (-1)
+#endif
+
+/*
+    Control of the magnet system over a local TCP socket, for automation scripts and feedback loops.
+    The server only listens on the loopback interface.
+
+    Every message is a frame of little-endian fields:
+        u32 length of the rest of the frame
+        u16 request id, echoed in the response
+        u8  number of operations, followed by the operations
+    An operation is a u8 code followed by its arguments (see ControlCode). A frame carries a batch of
+    operations that are executed in order. The response frame has the same header and one u8
+    ControlStatus per operation. A malformed frame closes the connection. The operations after an
+    unknown code cannot be decoded, so they are all answered with UnknownOperation.
+    At most CONTROL_MAX_CLIENTS clients are connected at a time; more are closed as they connect.
+    The server runs on the control loop, so it never blocks on a client: responses are queued per
+    client and sent as the socket takes them, and a client leaving more than CONTROL_MAX_PENDING bytes
+    of responses unread is closed.
+*/
+
+// Largest frame accepted, in bytes.
+#define CONTROL_MAX_FRAME 65536
+
+// Most clients connected at once, well below the sockets select() can wait for.
+#define CONTROL_MAX_CLIENTS 16
+
+// Most bytes of responses queued for a client that does not read them.
+#define CONTROL_MAX_PENDING 65536
+
+enum class ControlCode : uint8_t {
+    SetField = 1,      // f32 x, f32 y, f32 z: currents in amps
+    StartRotation = 2,
+    StartHopping = 3,  // u8 direction: 0 right, 1 up, 2 left, 3 down
+    Stop = 4,          // reset all power supplies
+    SetFrequency = 5,  // f32 frequency in Hz
+    SetAmplitude = 6,  // f32 z current, f32 xy current in amps
+    Ping = 7           // does nothing, to measure the round trip
+};
+
+enum class ControlStatus : uint8_t {
+    Ok = 0,
+    UnknownOperation = 1,
+    InvalidArgument = 2,
+    IOError = 3,       // a power supply did not accept the command
+    Skipped = 4        // superseded by a later operation of the same batch
+};
+
+struct ControlOperation {
+    ControlCode code;
+    float args[3];
+};
+
+// Number of float arguments of an operation, or -1 if the code is unknown.
+// StartHopping has one u8 argument, returned as 0 floats and decoded separately.
+inline int controlArgumentCount(ControlCode code) {
+    switch (code) {
+    case ControlCode::SetField:
+        return 3;
+    case ControlCode::SetFrequency:
+        return 1;
+    case ControlCode::SetAmplitude:
+        return 2;
+    case ControlCode::StartRotation:
+    case ControlCode::StartHopping:
+    case ControlCode::Stop:
+    case ControlCode::Ping:
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+inline void putU16(std::string* out, uint16_t value) {
+    out->push_back((char)(value & 0xFF));
+    out->push_back((char)(value >> 8));
+}
+
+inline void putU32(std::string* out, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        out->push_back((char)((value >> (8 * i)) & 0xFF));
+    }
+}
+
+inline void putF32(std::string* out, float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, 4);
+    putU32(out, bits);
+}
+
+inline uint32_t getU32(const unsigned char* data) {
+    return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+inline float getF32(const unsigned char* data) {
+    uint32_t bits = getU32(data);
+    float value;
+    memcpy(&value, &bits, 4);
+    return value;
+}
+
+// Encode a request frame.
+inline std::string encodeControlRequest(uint16_t id, const std::vector<ControlOperation>& operations) {
+    std::string body;
+    putU16(&body, id);
+    body.push_back((char)operations.size());
+    for (size_t i = 0; i < operations.size(); i++) {
+        body.push_back((char)operations[i].code);
+        if (operations[i].code == ControlCode::StartHopping) {
+            body.push_back((char)operations[i].args[0]);
+            continue;
+        }
+        for (int j = 0; j < controlArgumentCount(operations[i].code); j++) {
+            putF32(&body, operations[i].args[j]);
+        }
+    }
+    std::string frame;
+    putU32(&frame, (uint32_t)body.size());
+    return frame + body;
+}
+
+// Decode the body of a request frame (after the length). Returns false if it is malformed.
+// An unknown operation code ends the decoding: it and every operation after it are returned as
+// unknown operations, to be answered with UnknownOperation, so the batch still gets a status per operation.
+inline bool decodeControlRequest(const unsigned char* body, size_t length, uint16_t* id,
+    std::vector<ControlOperation>* operations) {
+    if (length < 3) {
+        return false;
+    }
+    *id = (uint16_t)(body[0] | (body[1] << 8));
+    int count = body[2];
+    size_t position = 3;
+    operations->clear();
+    for (int i = 0; i < count; i++) {
+        if (position >= length) {
+            return false;
+        }
+        ControlOperation operation = {};
+        operation.code = (ControlCode)body[position++];
+        int arguments = controlArgumentCount(operation.code);
+        if (arguments < 0) {
+            operations->resize(count, operation);
+            return true;
+        }
+        if (operation.code == ControlCode::StartHopping) {
+            if (position >= length) {
+                return false;
+            }
+            operation.args[0] = body[position++];
+        }
+        if (position + 4 * arguments > length) {
+            return false;
+        }
+        for (int j = 0; j < arguments; j++) {
+            operation.args[j] = getF32(body + position);
+            position += 4;
+        }
+        operations->push_back(operation);
+    }
+    return position == length;
+}
+
+inline void closeSocket(SocketHandle socket) {
+#ifdef _WIN32
+    closesocket(socket);
+#else
+    ::close(socket);
+#endif
+}
+
+// Open the socket library once per process.
+inline bool startSockets() {
+#ifdef _WIN32
+    static bool started = false;
+    if (!started) {
+        WSADATA data;
+        started = WSAStartup(MAKEWORD(2, 2), &data) == 0;
+    }
+    return started;
+#else
+    return true;
+#endif
+}
+
+// Turn off Nagle's algorithm, so small frames are sent at once.
+inline void setNoDelay(SocketHandle socket) {
+    int flag = 1;
+    setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, (const char*)&flag, sizeof(flag));
+}
+
+// Make sends and receives on `socket` return at once instead of waiting.
+inline bool setNonBlocking(SocketHandle socket) {
+#ifdef _WIN32
+    u_long flag = 1;
+    return ioctlsocket(socket, FIONBIO, &flag) == 0;
+#else
+    int flags = fcntl(socket, F_GETFL, 0);
+    return flags >= 0 && fcntl(socket, F_SETFL, flags | O_NONBLOCK) == 0;
+#endif
+}
+
+// Did the last call on a non-blocking socket fail only because it would have had to wait?
+inline bool socketWouldBlock() {
+#ifdef _WIN32
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+}
+
+// send() that fails with an error instead of raising SIGPIPE when the peer has closed the connection.
+inline int sendSocket(SocketHandle socket, const char* data, size_t length) {
+#if defined(_WIN32) || !defined(MSG_NOSIGNAL)
+    return (int)send(socket, data, (int)length, 0);
+#else
+    return (int)send(socket, data, length, MSG_NOSIGNAL);
+#endif
+}
+
+// Handler of a batch: fills one status per operation.
+typedef std::function<void(const std::vector<ControlOperation>&, std::vector<ControlStatus>*)> ControlHandler;
+
+class ControlServer {
+public:
+    ~ControlServer() {
+        close();
+    }
+
+    // Listen on 127.0.0.1:port.
+    bool listen(int port) {
+        if (!startSockets()) {
+            return false;
+        }
+        listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (listener == INVALID_SOCKET_HANDLE) {
+            return false;
+        }
+        int reuse = 1;
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse));
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_port = htons((unsigned short)port);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(listener, (sockaddr*)&address, sizeof(address)) != 0 || ::listen(listener, 4) != 0) {
+            close();
+            return false;
+        }
+        std::cout << "Listening for control connections on 127.0.0.1:" << port << "\n\n";
+        return true;
+    }
+
+    void close() {
+        for (size_t i = 0; i < clients.size(); i++) {
+            closeSocket(clients[i].socket);
+        }
+        clients.clear();
+        if (listener != INVALID_SOCKET_HANDLE) {
+            closeSocket(listener);
+        }
+        listener = INVALID_SOCKET_HANDLE;
+    }
+
+    // Wait up to timeoutMs for connections and requests, handle all complete frames, and send the
+    // queued responses the sockets take.
+    void poll(int timeoutMs, const ControlHandler& handler) {
+        fd_set readable;
+        fd_set writable;
+        FD_ZERO(&readable);
+        FD_ZERO(&writable);
+        FD_SET(listener, &readable);
+        SocketHandle highest = listener;
+        for (size_t i = 0; i < clients.size(); i++) {
+            FD_SET(clients[i].socket, &readable);
+            if (!clients[i].pending.empty()) {
+                FD_SET(clients[i].socket, &writable);
+            }
+            highest = clients[i].socket > highest ? clients[i].socket : highest;
+        }
+        timeval timeout;
+        timeout.tv_sec = timeoutMs / 1000;
+        timeout.tv_usec = (timeoutMs % 1000) * 1000;
+        if (select((int)highest + 1, &readable, &writable, NULL, &timeout) <= 0) {
+            return;
+        }
+        if (FD_ISSET(listener, &readable)) {
+            SocketHandle socket = accept(listener, NULL, NULL);
+#ifndef _WIN32
+            // select() cannot wait for a socket numbered FD_SETSIZE or more
+            if (socket != INVALID_SOCKET_HANDLE && socket >= FD_SETSIZE) {
+                closeSocket(socket);
+                socket = INVALID_SOCKET_HANDLE;
+            }
+#endif
+            if (socket != INVALID_SOCKET_HANDLE && clients.size() >= CONTROL_MAX_CLIENTS) {
+                closeSocket(socket);
+                rejected++;
+            }
+            else if (socket != INVALID_SOCKET_HANDLE && !setNonBlocking(socket)) {
+                closeSocket(socket);
+            }
+            else if (socket != INVALID_SOCKET_HANDLE) {
+                setNoDelay(socket);
+                clients.push_back(Client{ socket, std::string(), std::string() });
+            }
+        }
+        for (size_t i = 0; i < clients.size();) {
+            bool open = !FD_ISSET(clients[i].socket, &writable) || flush(&clients[i]);
+            open = open && (!FD_ISSET(clients[i].socket, &readable) || receive(&clients[i], handler));
+            if (!open) {
+                closeSocket(clients[i].socket);
+                clients.erase(clients.begin() + i);
+                continue;
+            }
+            i++;
+        }
+    }
+
+    // Requests handled and operations executed since the server started, clients turned away, and
+    // clients closed for leaving too many responses unread.
+    uint64_t requests = 0;
+    uint64_t operations = 0;
+    uint64_t rejected = 0;
+    uint64_t dropped = 0;
+
+private:
+    struct Client {
+        SocketHandle socket;
+        std::string received;
+        std::string pending; // responses not sent yet
+    };
+
+    // Send as much of the queued responses as the socket takes without waiting.
+    // Returns false to close the connection.
+    bool flush(Client* client) {
+        while (!client->pending.empty()) {
+            int length = sendSocket(client->socket, client->pending.data(), client->pending.size());
+            if (length <= 0) {
+                return length < 0 && socketWouldBlock();
+            }
+            client->pending.erase(0, length);
+        }
+        return true;
+    }
+
+    // Read what the client sent and answer its complete frames. Returns false to close the connection.
+    bool receive(Client* client, const ControlHandler& handler) {
+        char data[4096];
+        int length = (int)recv(client->socket, data, sizeof(data), 0);
+        if (length < 0 && socketWouldBlock()) {
+            return true;
+        }
+        if (length <= 0) {
+            return false;
+        }
+        client->received.append(data, length);
+        std::vector<ControlOperation> batch;
+        std::vector<ControlStatus> statuses;
+        size_t position = 0;
+        while (client->received.size() - position >= 4) {
+            const unsigned char* frame = (const unsigned char*)client->received.data() + position;
+            uint32_t bodyLength = getU32(frame);
+            if (bodyLength > CONTROL_MAX_FRAME) {
+                return false;
+            }
+            if (client->received.size() - position - 4 < bodyLength) {
+                break;
+            }
+            uint16_t id = 0;
+            if (!decodeControlRequest(frame + 4, bodyLength, &id, &batch)) {
+                return false;
+            }
+            statuses.assign(batch.size(), ControlStatus::Ok);
+            handler(batch, &statuses);
+            requests++;
+            operations += batch.size();
+            std::string body;
+            putU16(&body, id);
+            body.push_back((char)statuses.size());
+            for (size_t i = 0; i < statuses.size(); i++) {
+                body.push_back((char)statuses[i]);
+            }
+            putU32(&client->pending, (uint32_t)body.size());
+            client->pending += body;
+            position += 4 + bodyLength;
+        }
+        client->received.erase(0, position);
+        if (client->pending.size() > CONTROL_MAX_PENDING) {
+            dropped++;
+            return false;
+        }
+        // All responses to the frames of one read go out in one send if the socket takes them
+        return flush(client);
+    }
+
+    SocketHandle listener = INVALID_SOCKET_HANDLE;
+    std::vector<Client> clients;
+};
+
+// Blocking client of the control server, used to test it over loopback.
+class ControlClient {
+public:
+    ~ControlClient() {
+        if (socket != INVALID_SOCKET_HANDLE) {
+            closeSocket(socket);
+        }
+    }
+
+    bool connect(int port) {
+        if (!startSockets()) {
+            return false;
+        }
+        socket = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_port = htons((unsigned short)port);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (socket == INVALID_SOCKET_HANDLE || ::connect(socket, (sockaddr*)&address, sizeof(address)) != 0) {
+            return false;
+        }
+        setNoDelay(socket);
+        return true;
+    }
+
+    // Send a batch without waiting for its statuses. Returns false if the connection failed.
+    bool post(const std::vector<ControlOperation>& operations) {
+        std::string frame = encodeControlRequest(++lastId, operations);
+        return sendSocket(socket, frame.data(), frame.size()) == (int)frame.size();
+    }
+
+    // Send a batch and wait for its statuses. Returns false if the connection failed.
+    bool request(const std::vector<ControlOperation>& operations, std::vector<ControlStatus>* statuses) {
+        if (!post(operations)) {
+            return false;
+        }
+        unsigned char header[4];
+        if (!receiveAll(header, 4)) {
+            return false;
+        }
+        std::vector<unsigned char> body(getU32(header));
+        if (body.size() < 3 || !receiveAll(body.data(), body.size())) {
+            return false;
+        }
+        statuses->clear();
+        for (size_t i = 3; i < body.size(); i++) {
+            statuses->push_back((ControlStatus)body[i]);
+        }
+        return (uint16_t)(body[0] | (body[1] << 8)) == lastId;
+    }
+
+private:
+    bool receiveAll(unsigned char* data, size_t length) {
+        size_t received = 0;
+        while (received < length) {
+            int count = (int)recv(socket, (char*)data + received, (int)(length - received), 0);
+            if (count <= 0) {
+                return false;
+            }
+            received += count;
+        }
+        return true;
+    }
+
+    SocketHandle socket = INVALID_SOCKET_HANDLE;
+    uint16_t lastId = 0;
+};
+
+// Send `count` pings to the server on `port` and print the round-trip times.
+inline bool pingControlServer(int port, int count) {
+    ControlClient client;
+    if (!client.connect(port)) {
+        std::cout << "Cannot connect to 127.0.0.1:" << port << "\n";
+        return false;
+    }
+    std::vector<ControlOperation> ping(1);
+    ping[0].code = ControlCode::Ping;
+    std::vector<ControlStatus> statuses;
+    std::vector<double> times;
+    for (int i = 0; i < count; i++) {
+        std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+        if (!client.request(ping, &statuses)) {
+            std::cout << "Connection failed after " << i << " requests\n";
+            return false;
+        }
+        times.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - begin).count());
+    }
+    std::sort(times.begin(), times.end());
+    if (!times.empty()) {
+        printf("%d pings: median %.1f us, p99 %.1f us, max %.1f us\n", count, times[times.size() / 2],
+            times[(size_t)(0.99 * (times.size() - 1))], times.back());
+    }
+    return true;
+}
+
+// Drive the server on `port` through the operations of a session: a field, a rotation, hopping,
+// a stop, and a batch with an unknown code. Then flood it from a second client that never reads its
+// responses, which should be closed while the first one is still answered. Prints the status of every
+// operation and returns true if each one is as expected. The server moves the power supplies, so only
+// use it on a test setup.
+inline bool checkControlServer(int port) {
+    ControlClient client;
+    if (!client.connect(port)) {
+        std::cout << "Cannot connect to 127.0.0.1:" << port << "\n";
+        return false;
+    }
+    struct Step {
+        const char* name;
+        std::vector<ControlOperation> operations;
+        std::vector<ControlStatus> expected;
+    };
+    ControlOperation setField = { ControlCode::SetField, { 0.1f, -0.1f, 0.2f } };
+    ControlOperation rotation = { ControlCode::StartRotation, {} };
+    ControlOperation hopping = { ControlCode::StartHopping, { 1 } };
+    ControlOperation stop = { ControlCode::Stop, {} };
+    ControlOperation unknown = { (ControlCode)200, {} };
+    ControlOperation ping = { ControlCode::Ping, {} };
+    std::vector<Step> steps = {
+        { "SetField", { setField }, { ControlStatus::Ok } },
+        { "StartRotation", { rotation }, { ControlStatus::Ok } },
+        { "StartHopping", { hopping }, { ControlStatus::Ok } },
+        { "Stop", { stop }, { ControlStatus::Ok } },
+        { "Ping, unknown, Ping", { ping, unknown, ping },
+            { ControlStatus::Ok, ControlStatus::UnknownOperation, ControlStatus::UnknownOperation } }
+    };
+    bool passed = true;
+    for (size_t i = 0; i < steps.size(); i++) {
+        std::vector<ControlStatus> statuses;
+        if (!client.request(steps[i].operations, &statuses)) {
+            std::cout << steps[i].name << ": connection failed\n";
+            return false;
+        }
+        bool expected = statuses == steps[i].expected;
+        std::cout << steps[i].name << ":";
+        for (size_t j = 0; j < statuses.size(); j++) {
+            std::cout << " " << (int)statuses[j];
+        }
+        std::cout << (expected ? " ok\n" : " unexpected\n");
+        passed = passed && expected;
+    }
+
+    ControlClient flooder;
+    std::vector<ControlOperation> pings(255, ping);
+    int batches = 0;
+    bool closed = !flooder.connect(port);
+    for (; batches < 100000 && !closed; batches++) {
+        closed = !flooder.post(pings);
+    }
+    std::vector<ControlStatus> statuses;
+    bool answered = client.request(std::vector<ControlOperation>(1, ping), &statuses);
+    std::cout << "Unread client: " << (closed ? "closed" : "still open") << " after " << batches << " batches, "
+        << (answered ? "others answered" : "others not answered") << (closed && answered ? " ok\n" : " unexpected\n");
+    return passed && closed && answered;
+}
@@ -0,0 +1,147 @@
+#pragma once
+
+#include <string.h>
+#include <ctype.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <thread>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include "visa.h"
+#include "SessionManager.h"
+
+/*
+    Discovery of the power supplies connected to the computer.
+    All serial resources are enumerated with viFindRsrc and identified in parallel with *idn?,
+    so a COM port that does not answer only costs one short timeout for the whole search.
+    The supplies are mapped to the axes by serial number, which survives COM-port renumbering.
+*/
+
+// A resource found by the resource manager and its identification.
+struct DiscoveredDevice {
+    std::string descriptor;
+    std::string idn;
+    std::string serial;
+};
+
+// List the resources matching `expression`, e.g. "ASRL?*::INSTR" for all serial ports.
+inline std::vector<std::string> findResources(ViSession defaultRM, const char* expression) {
+    std::vector<std::string> resources;
+    ViFindList findList;
+    ViUInt32 count = 0;
+    ViChar descriptor[VI_FIND_BUFLEN];
+    if (viFindRsrc(defaultRM, (ViString)expression, &findList, &count, descriptor) < VI_SUCCESS) {
+        return resources;
+    }
+    resources.push_back(descriptor);
+    for (ViUInt32 i = 1; i < count; i++) {
+        if (viFindNext(findList, descriptor) < VI_SUCCESS) {
+            break;
+        }
+        resources.push_back(descriptor);
+    }
+    viClose(findList);
+    return resources;
+}
+
+// Open the resource of `device`, ask for its identification and fill in `idn` and `serial`.
+// The identification string is "manufacturer,model,serial,firmware".
+// Leaves both empty if the resource cannot be opened or does not answer within timeoutMs.
+// Sessions of identified devices go back to the pool so the power supplies can reuse them.
+inline void identifyDevice(SessionManager* manager, DiscoveredDevice* device, int timeoutMs) {
+    SessionHandle session;
+    if (manager->acquire(device->descriptor.c_str(), timeoutMs, &session) < VI_SUCCESS) {
+        return;
+    }
+    ViSession instr = session.get();
+    const char* command = "*idn?\n";
+    unsigned char buffer[256] = {};
+    ViUInt32 count = 0;
+    if (viWrite(instr, (ViBuf)command, (ViUInt32)strlen(command), &count) >= VI_SUCCESS
+        && viRead(instr, buffer, sizeof(buffer) - 1, &count) >= VI_SUCCESS) {
+        device->idn = std::string((char*)buffer, count);
+        while (!device->idn.empty() && (device->idn.back() == '\n' || device->idn.back() == '\r')) {
+            device->idn.pop_back();
+        }
+        std::stringstream fields(device->idn);
+        std::string field;
+        for (int i = 0; i < 3 && std::getline(fields, field, ','); i++) {
+            if (i == 2 && field.find_first_not_of(' ') != std::string::npos) {
+                device->serial = field.substr(field.find_first_not_of(' '));
+            }
+        }
+    }
+    if (device->idn.empty()) {
+        session.discard();
+    }
+}
+
+// Enumerate the serial resources and identify all of them concurrently.
+// Only the resources that answered the identification query are returned.
+inline std::vector<DiscoveredDevice> discoverDevices(SessionManager* manager, int timeoutMs) {
+    std::vector<std::string> resources = findResources(manager->resourceManager(), "ASRL?*::INSTR");
+    std::vector<DiscoveredDevice> devices(resources.size());
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < resources.size(); i++) {
+        devices[i].descriptor = resources[i];
+        threads.push_back(std::thread(identifyDevice, manager, &devices[i], timeoutMs));
+    }
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+    std::vector<DiscoveredDevice> identified;
+    for (size_t i = 0; i < devices.size(); i++) {
+        if (!devices[i].idn.empty()) {
+            std::cout << "Found " << devices[i].descriptor << ": " << devices[i].idn << "\n";
+            identified.push_back(devices[i]);
+        }
+    }
+    std::cout << "\n";
+    return identified;
+}
+
+// Read the axis map, one "<axis> <serial>" pair per line, e.g. "X E1234".
+// Empty lines and lines starting with '#' are ignored.
+inline std::map<char, std::string> loadAxisMap(const char* path) {
+    std::map<char, std::string> axisMap;
+    std::ifstream file(path);
+    std::string line;
+    while (std::getline(file, line)) {
+        std::stringstream fields(line);
+        std::string axis;
+        std::string serial;
+        if (fields >> axis >> serial && axis[0] != '#') {
+            axisMap[(char)toupper(axis[0])] = serial;
+        }
+    }
+    return axisMap;
+}
+
+// Replace the descriptors of the X, Y and Z supplies with the resources whose serial numbers
+// match the axis map. Axes without a match keep the descriptor they were given.
+// Returns true if all three axes were found.
+inline bool assignAxes(const std::vector<DiscoveredDevice>& devices, const std::map<char, std::string>& axisMap,
+    std::string descriptors[3]) {
+    const char axes[3] = { 'X', 'Y', 'Z' };
+    int found = 0;
+    for (int i = 0; i < 3; i++) {
+        std::map<char, std::string>::const_iterator serial = axisMap.find(axes[i]);
+        if (serial == axisMap.end()) {
+            continue;
+        }
+        for (size_t j = 0; j < devices.size(); j++) {
+            if (devices[j].serial == serial->second) {
+                descriptors[i] = devices[j].descriptor;
+                found++;
+                break;
+            }
+        }
+    }
+    for (int i = 0; i < 3; i++) {
+        std::cout << axes[i] << " axis: " << descriptors[i] << "\n";
+    }
+    std::cout << "\n";
+    return found == 3;
+}
@@ -0,0 +1,186 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include <string>
+#include "visa.h"
+
+/*
+    Running totals of the traffic to one power supply, to spot a port that degrades during a run.
+    Every write adds to the counters of its port: bytes, latency, and the VISA status of a failure.
+    The counters are relaxed atomics, so any thread can take a PortStats copy with query()
+    while the I/O threads write, without locking them out. The copy is consistent per counter,
+    not across counters, which is enough for rates and error ratios.
+    Bytes saved are the bytes a plain upload would have sent: the legacy encoding of every list,
+    and the upload a recalled list memory slot replaced.
+*/
+
+// Upper bounds of the write latency buckets, in microseconds; the last bucket holds the rest
+#define IO_LATENCY_BUCKETS 10
+static const double IO_LATENCY_BOUNDS_US[IO_LATENCY_BUCKETS - 1] = { 100, 300, 1000, 3000, 10000, 30000, 100000, 300000,
+    1000000 };
+
+// Distinct failure statuses counted per port; later ones are counted together as other
+#define IO_ERROR_CODES 8
+
+enum class SavedBy {
+    Encoding, // compact list encodings instead of the legacy ASCII one
+    Slots     // recalled list memory slots instead of uploads
+};
+
+// Copy of the counters of one port.
+struct PortStats {
+    uint64_t writes = 0;
+    uint64_t bytes = 0;
+    uint64_t failedWrites = 0;
+    uint64_t readErrors = 0;
+    ViStatus errorCodes[IO_ERROR_CODES] = {};
+    uint64_t errorCounts[IO_ERROR_CODES] = {};
+    uint64_t otherErrors = 0;
+    uint64_t latency[IO_LATENCY_BUCKETS] = {};
+    double latencySumUs = 0;
+    double maxLatencyUs = 0;
+    int queueDepth = 0;    // sends in progress on the port, waiting for it or writing
+    int maxQueueDepth = 0;
+    uint64_t savedByEncoding = 0;
+    uint64_t savedBySlots = 0;
+
+    // Upper bound of the bucket holding the `fraction` quantile of the write latency, in microseconds,
+    // or the largest latency seen if that is lower.
+    double latencyQuantile(double fraction) const {
+        uint64_t rank = (uint64_t)(fraction * writes);
+        uint64_t seen = 0;
+        for (int i = 0; i < IO_LATENCY_BUCKETS - 1; i++) {
+            seen += latency[i];
+            if (seen > rank) {
+                return IO_LATENCY_BOUNDS_US[i] < maxLatencyUs ? IO_LATENCY_BOUNDS_US[i] : maxLatencyUs;
+            }
+        }
+        return maxLatencyUs;
+    }
+
+    void report(const std::string& name) const {
+        printf("%s: %llu writes, %llu bytes, %llu failed, %llu failed reads, latency mean %.3f ms, p50 <= %.3f ms, "
+            "p99 <= %.3f ms, max %.3f ms, queue depth %d (max %d), %llu bytes saved by encoding, %llu by list slots\n",
+            name.c_str(), (unsigned long long)writes, (unsigned long long)bytes, (unsigned long long)failedWrites,
+            (unsigned long long)readErrors, writes > 0 ? latencySumUs / writes / 1000 : 0.0, latencyQuantile(0.5) / 1000,
+            latencyQuantile(0.99) / 1000, maxLatencyUs / 1000, queueDepth, maxQueueDepth,
+            (unsigned long long)savedByEncoding, (unsigned long long)savedBySlots);
+        for (int i = 0; i < IO_ERROR_CODES && errorCounts[i] > 0; i++) {
+            printf("  status 0x%08lX: %llu\n", (unsigned long)errorCodes[i], (unsigned long long)errorCounts[i]);
+        }
+        if (otherErrors > 0) {
+            printf("  other statuses: %llu\n", (unsigned long long)otherErrors);
+        }
+    }
+};
+
+class PortCounters {
+public:
+    PortCounters() {
+        for (int i = 0; i < IO_ERROR_CODES; i++) {
+            errorCodes[i].store(VI_SUCCESS);
+            errorCounts[i].store(0);
+        }
+        for (int i = 0; i < IO_LATENCY_BUCKETS; i++) {
+            latency[i].store(0);
+        }
+    }
+
+    // Count a write of `bytes` that took `us` microseconds and returned `status`.
+    void recordWrite(ViStatus status, size_t bytes, double us) {
+        writes.fetch_add(1, std::memory_order_relaxed);
+        this->bytes.fetch_add(bytes, std::memory_order_relaxed);
+        int bucket = 0;
+        while (bucket < IO_LATENCY_BUCKETS - 1 && us >= IO_LATENCY_BOUNDS_US[bucket]) {
+            bucket++;
+        }
+        latency[bucket].fetch_add(1, std::memory_order_relaxed);
+        uint64_t ns = (uint64_t)(us * 1000);
+        latencySumNs.fetch_add(ns, std::memory_order_relaxed);
+        uint64_t max = maxLatencyNs.load(std::memory_order_relaxed);
+        while (ns > max && !maxLatencyNs.compare_exchange_weak(max, ns, std::memory_order_relaxed)) {
+        }
+        if (status < VI_SUCCESS) {
+            failedWrites.fetch_add(1, std::memory_order_relaxed);
+            countError(status);
+        }
+    }
+
+    void recordReadError() {
+        readErrors.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void addSaved(SavedBy by, uint64_t bytes) {
+        (by == SavedBy::Encoding ? savedByEncoding : savedBySlots).fetch_add(bytes, std::memory_order_relaxed);
+    }
+
+    // A send started waiting for the port, and leave() it finished.
+    void enter() {
+        int depth = queueDepth.fetch_add(1) + 1;
+        int max = maxQueueDepth.load(std::memory_order_relaxed);
+        while (depth > max && !maxQueueDepth.compare_exchange_weak(max, depth, std::memory_order_relaxed)) {
+        }
+    }
+
+    void leave() {
+        queueDepth.fetch_sub(1);
+    }
+
+    // Current values of the counters, from any thread.
+    PortStats query() const {
+        PortStats stats;
+        stats.writes = writes.load(std::memory_order_relaxed);
+        stats.bytes = bytes.load(std::memory_order_relaxed);
+        stats.failedWrites = failedWrites.load(std::memory_order_relaxed);
+        stats.readErrors = readErrors.load(std::memory_order_relaxed);
+        for (int i = 0; i < IO_ERROR_CODES; i++) {
+            stats.errorCodes[i] = errorCodes[i].load(std::memory_order_acquire);
+            stats.errorCounts[i] = errorCounts[i].load(std::memory_order_relaxed);
+        }
+        stats.otherErrors = otherErrors.load(std::memory_order_relaxed);
+        for (int i = 0; i < IO_LATENCY_BUCKETS; i++) {
+            stats.latency[i] = latency[i].load(std::memory_order_relaxed);
+        }
+        stats.latencySumUs = latencySumNs.load(std::memory_order_relaxed) / 1000.0;
+        stats.maxLatencyUs = maxLatencyNs.load(std::memory_order_relaxed) / 1000.0;
+        stats.queueDepth = queueDepth.load(std::memory_order_relaxed);
+        stats.maxQueueDepth = maxQueueDepth.load(std::memory_order_relaxed);
+        stats.savedByEncoding = savedByEncoding.load(std::memory_order_relaxed);
+        stats.savedBySlots = savedBySlots.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+private:
+    // Count `status` in its entry, claiming a free entry for a status not seen before.
+    void countError(ViStatus status) {
+        for (int i = 0; i < IO_ERROR_CODES; i++) {
+            ViStatus code = errorCodes[i].load(std::memory_order_acquire);
+            if (code == VI_SUCCESS) {
+                ViStatus empty = VI_SUCCESS;
+                code = errorCodes[i].compare_exchange_strong(empty, status, std::memory_order_acq_rel) ? status : empty;
+            }
+            if (code == status) {
+                errorCounts[i].fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+        }
+        otherErrors.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    std::atomic<uint64_t> writes{ 0 };
+    std::atomic<uint64_t> bytes{ 0 };
+    std::atomic<uint64_t> failedWrites{ 0 };
+    std::atomic<uint64_t> readErrors{ 0 };
+    std::atomic<ViStatus> errorCodes[IO_ERROR_CODES];
+    std::atomic<uint64_t> errorCounts[IO_ERROR_CODES];
+    std::atomic<uint64_t> otherErrors{ 0 };
+    std::atomic<uint64_t> latency[IO_LATENCY_BUCKETS];
+    std::atomic<uint64_t> latencySumNs{ 0 };
+    std::atomic<uint64_t> maxLatencyNs{ 0 };
+    std::atomic<int> queueDepth{ 0 };
+    std::atomic<int> maxQueueDepth{ 0 };
+    std::atomic<uint64_t> savedByEncoding{ 0 };
+    std::atomic<uint64_t> savedBySlots{ 0 };
+};
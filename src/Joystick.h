@@ -0,0 +1,95 @@
+#pragma once
+
+#include <math.h>
+#include <chrono>
+
+/*
+    Polar steering of the xy field with a joystick.
+    The linear mode scales x and y by the stick independently, so the field is sqrt(2) stronger on the
+    diagonals. The polar mode only takes the direction of the stick: its angle, from a polynomial atan2,
+    indexes a table of unit vectors, and the field keeps its magnitude in every direction. A new
+    set-point is only sent when the direction moves to another entry of the table, and at most
+    `rate` times per second, so the serial links are not flooded while the stick moves. The caller
+    asks for the set-point again with resend() when the power supplies no longer hold it.
+*/
+
+// Entries of the unit vector table, a power of two: 0.35 degrees apart
+#define JOYSTICK_ANGLES 1024
+#define JOYSTICK_TWO_PI 6.28318530717958647692
+
+// Cosines and sines of JOYSTICK_ANGLES angles around the circle, computed once.
+struct UnitCircleTable {
+    float cosines[JOYSTICK_ANGLES];
+    float sines[JOYSTICK_ANGLES];
+
+    UnitCircleTable() {
+        for (int i = 0; i < JOYSTICK_ANGLES; i++) {
+            cosines[i] = (float)cos(i * JOYSTICK_TWO_PI / JOYSTICK_ANGLES);
+            sines[i] = (float)sin(i * JOYSTICK_TWO_PI / JOYSTICK_ANGLES);
+        }
+    }
+};
+
+inline const UnitCircleTable& unitCircle() {
+    static const UnitCircleTable table;
+    return table;
+}
+
+// atan2 within 2e-4 radians, well below the spacing of the table, from a polynomial on the first octant.
+inline float fastAtan2(float y, float x) {
+    float ax = fabsf(x);
+    float ay = fabsf(y);
+    float largest = ax > ay ? ax : ay;
+    if (largest == 0) {
+        return 0;
+    }
+    float a = (ax < ay ? ax : ay) / largest;
+    float s = a * a;
+    float r = ((-0.0464964749f * s + 0.15931422f) * s - 0.327622764f) * s * a + a;
+    if (ay > ax) {
+        r = 1.57079637f - r;
+    }
+    if (x < 0) {
+        r = 3.14159274f - r;
+    }
+    return y < 0 ? -r : r;
+}
+
+class JoystickSteering {
+public:
+    float deadZone = 7849; // stick deflection below which the field is off, of 32767
+    double rate = 50;      // most set-points per second
+
+    // Set-points for the stick at (thumbX, thumbY) with a field of `magnitude` amps.
+    // Returns false, leaving x and y unchanged, if no new set-point should be sent.
+    bool update(float thumbX, float thumbY, float magnitude, float* x, float* y) {
+        int index = -1;
+        if (thumbX * thumbX + thumbY * thumbY > deadZone * deadZone) {
+            float turns = fastAtan2(thumbY, thumbX) * (float)(JOYSTICK_ANGLES / JOYSTICK_TWO_PI);
+            index = (int)floorf(turns + 0.5f) & (JOYSTICK_ANGLES - 1);
+        }
+        if (index == lastIndex && magnitude == lastMagnitude) {
+            return false;
+        }
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        if (std::chrono::duration<double>(now - lastSent).count() < 1 / rate) {
+            return false;
+        }
+        lastIndex = index;
+        lastMagnitude = magnitude;
+        lastSent = now;
+        *x = index < 0 ? 0 : unitCircle().cosines[index] * magnitude;
+        *y = index < 0 ? 0 : unitCircle().sines[index] * magnitude;
+        return true;
+    }
+
+    // Send the set-points again on the next update, even if the stick did not move.
+    void resend() {
+        lastIndex = -2;
+    }
+
+private:
+    int lastIndex = -2; // nothing sent yet
+    float lastMagnitude = 0;
+    std::chrono::steady_clock::time_point lastSent;
+};
@@ -0,0 +1,275 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <string>
+#include <vector>
+#include <iostream>
+
+/*
+    Encoding of current lists for the serial link.
+    The original encoding sends every value as 5 characters of ASCII text, 8 values per command.
+    When the power supply supports it, a list is sent as IEEE-488.2 definite-length binary blocks
+    of 32-bit floats, otherwise as ASCII with just enough decimals for the resolution of the DAC.
+    Both pack as many values into a command as fit the size of the original commands.
+    If the power supply takes a dwell time per point, runs of equal values (like the holds of the
+    hopping waveform) are sent as single points with a longer dwell.
+*/
+
+// Longest list command sent to the power supplies, in bytes: "list:curr " and 8 values of 6 bytes.
+#define LIST_COMMAND_BYTES 58
+
+enum class ListEncoding {
+    LegacyAscii,  // 5 characters per value, 8 values per command
+    CompactAscii, // decimals matching the DAC resolution, trailing zeros removed
+    BinaryBlock   // #<digits><length><big-endian float32 values>
+};
+
+inline const char* listEncodingName(ListEncoding encoding) {
+    switch (encoding) {
+    case ListEncoding::LegacyAscii:
+        return "legacy ASCII";
+    case ListEncoding::CompactAscii:
+        return "compact ASCII";
+    default:
+        return "binary block";
+    }
+}
+
+// Size of one list upload on the wire, compared to the legacy encoding.
+struct UploadStats {
+    int samples = 0;
+    int points = 0;
+    int commands = 0;
+    size_t bytesOnWire = 0;
+    size_t legacyBytes = 0;
+    double ms = 0;
+
+    void add(const UploadStats& other) {
+        samples += other.samples;
+        points += other.points;
+        commands += other.commands;
+        bytesOnWire += other.bytesOnWire;
+        legacyBytes += other.legacyBytes;
+        ms += other.ms;
+    }
+
+    void report(const std::string& name, ListEncoding encoding) const {
+        std::cout << name << ": " << samples << " samples as " << points << " points in " << commands << " commands, "
+            << bytesOnWire << " bytes (" << legacyBytes << " legacy), " << listEncodingName(encoding) << ", " << ms << " ms\n";
+    }
+};
+
+// Number of decimals needed to resolve steps of `resolution` amps.
+inline int decimalsForResolution(float resolution) {
+    if (resolution <= 0) {
+        return 5;
+    }
+    int decimals = (int)ceil(-log10(resolution));
+    return decimals < 0 ? 0 : (decimals > 6 ? 6 : decimals);
+}
+
+// The original encoding: the first 5 characters of std::to_string.
+inline std::string legacyValue(float value) {
+    return std::to_string(value).substr(0, 5);
+}
+
+// Shortest text for `value` rounded to `decimals` decimals, e.g. "-.25", "1", "0".
+inline std::string compactValue(float value, int decimals) {
+    char text[32];
+    sprintf(text, "%.*f", decimals, value);
+    int length = (int)strlen(text);
+    if (strchr(text, '.') != NULL) {
+        while (text[length - 1] == '0') {
+            length--;
+        }
+        if (text[length - 1] == '.') {
+            length--;
+        }
+    }
+    text[length] = '\0';
+    std::string result(text);
+    if (result == "-0") {
+        return "0";
+    }
+    if (result.compare(0, 2, "0.") == 0) {
+        return result.substr(1);
+    }
+    if (result.compare(0, 3, "-0.") == 0) {
+        return "-" + result.substr(2);
+    }
+    return result;
+}
+
+// IEEE-488.2 definite-length block of big-endian 32-bit floats.
+inline std::string binaryBlock(const float* values, int length) {
+    std::string bytes = std::to_string(length * 4);
+    std::string block = "#" + std::to_string(bytes.size()) + bytes;
+    for (int i = 0; i < length; i++) {
+        unsigned int bits;
+        memcpy(&bits, &values[i], 4);
+        block += (char)(bits >> 24);
+        block += (char)(bits >> 16);
+        block += (char)(bits >> 8);
+        block += (char)bits;
+    }
+    return block;
+}
+
+// Join values into commands starting with `prefix`, as many per command as fit LIST_COMMAND_BYTES.
+inline std::vector<std::string> packAsciiCommands(const std::string& prefix, const std::vector<std::string>& values) {
+    std::vector<std::string> commands;
+    std::string command = prefix;
+    for (size_t i = 0; i < values.size(); i++) {
+        if (command.size() > prefix.size() && command.size() + 1 + values[i].size() + 1 > LIST_COMMAND_BYTES) {
+            commands.push_back(command + "\n");
+            command = prefix;
+        }
+        command += (command.size() > prefix.size() ? "," : "") + values[i];
+    }
+    if (command.size() > prefix.size()) {
+        commands.push_back(command + "\n");
+    }
+    return commands;
+}
+
+// Merge runs of equal consecutive values into single points that dwell for the whole run.
+// Runs are split where their dwell would exceed maxDwell.
+inline void compressHolds(const float* values, int length, float dwell, float maxDwell,
+    std::vector<float>* points, std::vector<float>* dwells) {
+    points->clear();
+    dwells->clear();
+    for (int i = 0; i < length; i++) {
+        if (!points->empty() && points->back() == values[i] && dwells->back() + dwell <= maxDwell) {
+            dwells->back() += dwell;
+        }
+        else {
+            points->push_back(values[i]);
+            dwells->push_back(dwell);
+        }
+    }
+}
+
+// Build the "list:dwel" commands for a dwell time per point.
+inline std::vector<std::string> encodeDwellCommands(const std::vector<float>& dwells) {
+    std::vector<std::string> values;
+    for (size_t i = 0; i < dwells.size(); i++) {
+        values.push_back(compactValue(dwells[i], 6));
+    }
+    return packAsciiCommands("list:dwel ", values);
+}
+
+// Build the "list:curr" commands for a list of values.
+// decimals is only used by the compact ASCII encoding.
+inline std::vector<std::string> encodeListCommands(const float* values, int length, ListEncoding encoding, int decimals) {
+    std::vector<std::string> commands;
+    const std::string prefix = "list:curr ";
+    if (encoding == ListEncoding::LegacyAscii) {
+        for (int i = 0; i < length; i += 8) {
+            std::string command = prefix;
+            for (int j = i; j < i + 8 && j < length; j++) {
+                command += (j > i ? "," : "") + legacyValue(values[j]);
+            }
+            commands.push_back(command + "\n");
+        }
+    }
+    else if (encoding == ListEncoding::BinaryBlock) {
+        // prefix, "#2", two length digits and the terminating newline
+        int perCommand = (LIST_COMMAND_BYTES - (int)prefix.size() - 5) / 4;
+        for (int i = 0; i < length; i += perCommand) {
+            int count = length - i < perCommand ? length - i : perCommand;
+            commands.push_back(prefix + binaryBlock(values + i, count) + "\n");
+        }
+    }
+    else {
+        std::vector<std::string> text;
+        for (int i = 0; i < length; i++) {
+            text.push_back(compactValue(values[i], decimals));
+        }
+        commands = packAsciiCommands(prefix, text);
+    }
+    return commands;
+}
+
+// Total number of bytes of `commands`.
+inline size_t commandBytes(const std::vector<std::string>& commands) {
+    size_t bytes = 0;
+    for (size_t i = 0; i < commands.size(); i++) {
+        bytes += commands[i].size();
+    }
+    return bytes;
+}
+
+// A list encoded for one power supply, ready to be sent. Encoding does not touch the serial link,
+// so the next list can be prepared on another thread while the current one plays.
+struct PreparedList {
+    std::vector<float> values;
+    float voltageLimit = 0;
+    float dwell = 0;
+    int count = 0;
+    std::vector<std::string> commands;
+    ListEncoding encoding = ListEncoding::LegacyAscii;
+    bool compressed = false;
+    int points = 0;         // points after merging holds
+    size_t legacyBytes = 0; // size of the list in the legacy encoding
+};
+
+// Values of a comma-separated response, like the one to "list:curr?".
+inline std::vector<float> parseListResponse(const std::string& response) {
+    std::vector<float> values;
+    const char* text = response.c_str();
+    char* end = NULL;
+    for (;;) {
+        float value = strtof(text, &end);
+        if (end == text) {
+            return values;
+        }
+        values.push_back(value);
+        text = end;
+        while (*text == ',' || *text == ' ') {
+            text++;
+        }
+    }
+}
+
+// Compare a list read back from the power supply with the one that was sent. Returns the number of
+// values off by more than `tolerance`, counting every missing or extra value, and sets the largest
+// error and the index of the first mismatch (-1 if there is none).
+inline int compareLists(const std::vector<float>& expected, const std::vector<float>& actual, float tolerance,
+    float* maxError, int* firstMismatch) {
+    int mismatches = 0;
+    *maxError = 0;
+    *firstMismatch = -1;
+    size_t common = expected.size() < actual.size() ? expected.size() : actual.size();
+    for (size_t i = 0; i < common; i++) {
+        float error = fabs(expected[i] - actual[i]);
+        *maxError = error > *maxError ? error : *maxError;
+        if (error > tolerance) {
+            mismatches++;
+            *firstMismatch = *firstMismatch < 0 ? (int)i : *firstMismatch;
+        }
+    }
+    if (expected.size() != actual.size()) {
+        mismatches += (int)(expected.size() > actual.size() ? expected.size() - actual.size() : actual.size() - expected.size());
+        *firstMismatch = *firstMismatch < 0 ? (int)common : *firstMismatch;
+    }
+    return mismatches;
+}
+
+// Readbacks of uploaded lists.
+struct VerifyStats {
+    int lists = 0;
+    int failed = 0;      // lists with mismatched values or dwell times, or that could not be read
+    float maxError = 0;  // largest current error in amps
+    double ms = 0;
+
+    void report(const std::string& name) const {
+        if (lists == 0) {
+            return;
+        }
+        std::cout << name << ": " << lists << " lists verified, " << failed << " failed, max error " << maxError
+            << " A, " << ms << " ms\n";
+    }
+};
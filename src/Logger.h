@@ -0,0 +1,215 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "Platform.h"
+
+/*
+    Asynchronous logger, so that console output never delays the writes to the power supplies.
+    Every thread formats its messages into its own lock-free single-producer ring buffer;
+    a background thread drains the buffers and writes them to the console.
+    If a buffer is full the message is dropped and counted instead of blocking the caller.
+    Buffers of finished threads are reused by new threads, since a thread is started for every
+    concurrent command. Each buffer also measures the time spent in its log calls.
+*/
+
+enum class LogLevel {
+    Debug,
+    Info,
+    Warning,
+    Error,
+    Off
+};
+
+#define LOG_ENTRY_TEXT 240
+#define LOG_BUFFER_ENTRIES 1024
+
+struct LogEntry {
+    uint64_t timestampNs;
+    LogLevel level;
+    int length;
+    char text[LOG_ENTRY_TEXT];
+};
+
+// Ring buffer written by one thread and read by the flusher.
+struct LogBuffer {
+    LogEntry entries[LOG_BUFFER_ENTRIES];
+    std::atomic<uint64_t> head; // next entry to write, only changed by the owner
+    std::atomic<uint64_t> tail; // next entry to read, only changed by the flusher
+    std::atomic<bool> owned;
+    // Statistics of the owner's log calls
+    std::atomic<uint64_t> calls;
+    std::atomic<uint64_t> dropped;
+    std::atomic<uint64_t> callNs;
+
+    LogBuffer() : head(0), tail(0), owned(true), calls(0), dropped(0), callNs(0) {
+    }
+};
+
+class Logger {
+public:
+    // The logger shared by the whole process. Starts the flusher on first use.
+    static Logger& instance() {
+        static Logger logger;
+        return logger;
+    }
+
+    ~Logger() {
+        running = false;
+        if (flusher.joinable()) {
+            flusher.join();
+        }
+        flush();
+        for (size_t i = 0; i < buffers.size(); i++) {
+            delete buffers[i];
+        }
+    }
+
+    void setLevel(LogLevel level) {
+        minLevel.store((int)level, std::memory_order_relaxed);
+    }
+
+    bool enabled(LogLevel level) const {
+        return (int)level >= minLevel.load(std::memory_order_relaxed);
+    }
+
+    // Format a message into the ring buffer of the calling thread. Never blocks.
+    void log(LogLevel level, const char* format, va_list args) {
+        std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+        LogBuffer* buffer = threadBuffer();
+        uint64_t head = buffer->head.load(std::memory_order_relaxed);
+        if (head - buffer->tail.load(std::memory_order_acquire) >= LOG_BUFFER_ENTRIES) {
+            buffer->dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        LogEntry* entry = &buffer->entries[head % LOG_BUFFER_ENTRIES];
+        entry->timestampNs = std::chrono::duration_cast<std::chrono::nanoseconds>(begin - start).count();
+        entry->level = level;
+        int length = vsnprintf(entry->text, LOG_ENTRY_TEXT, format, args);
+        entry->length = length < 0 ? 0 : (length >= LOG_ENTRY_TEXT ? LOG_ENTRY_TEXT - 1 : length);
+        buffer->head.store(head + 1, std::memory_order_release);
+        buffer->calls.fetch_add(1, std::memory_order_relaxed);
+        buffer->callNs.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - begin).count(), std::memory_order_relaxed);
+    }
+
+    // Write all pending messages to the console.
+    void flush() {
+        std::lock_guard<std::mutex> guard(flushLock);
+        std::vector<LogBuffer*> snapshot;
+        {
+            std::lock_guard<std::mutex> registryGuard(registryLock);
+            snapshot = buffers;
+        }
+        static const char* levelNames[4] = { "debug", "info", "warning", "error" };
+        for (size_t i = 0; i < snapshot.size(); i++) {
+            LogBuffer* buffer = snapshot[i];
+            uint64_t tail = buffer->tail.load(std::memory_order_relaxed);
+            uint64_t head = buffer->head.load(std::memory_order_acquire);
+            for (; tail != head; tail++) {
+                const LogEntry& entry = buffer->entries[tail % LOG_BUFFER_ENTRIES];
+                fprintf(stdout, "[%10.3f ms %s] %.*s", entry.timestampNs / 1e6, levelNames[(int)entry.level],
+                    entry.length, entry.text);
+                if (entry.length == 0 || entry.text[entry.length - 1] != '\n') {
+                    fputc('\n', stdout);
+                }
+            }
+            buffer->tail.store(tail, std::memory_order_release);
+        }
+        fflush(stdout);
+    }
+
+    // Print the number of log calls, the dropped messages and the mean time spent per call.
+    void report() {
+        flush();
+        uint64_t calls = 0;
+        uint64_t dropped = 0;
+        uint64_t callNs = 0;
+        {
+            std::lock_guard<std::mutex> guard(registryLock);
+            for (size_t i = 0; i < buffers.size(); i++) {
+                calls += buffers[i]->calls.load();
+                dropped += buffers[i]->dropped.load();
+                callNs += buffers[i]->callNs.load();
+            }
+        }
+        printf("Log: %llu messages, %llu dropped, %.0f ns per call\n\n", (unsigned long long)calls,
+            (unsigned long long)dropped, calls > 0 ? (double)callNs / calls : 0.0);
+    }
+
+private:
+    // Releases the buffer of a thread when the thread ends.
+    struct ThreadHandle {
+        LogBuffer* buffer = NULL;
+
+        ~ThreadHandle() {
+            if (buffer != NULL) {
+                buffer->owned.store(false, std::memory_order_release);
+            }
+        }
+    };
+
+    Logger() : minLevel((int)LogLevel::Debug), running(true) {
+        start = std::chrono::steady_clock::now();
+        flusher = std::thread(&Logger::flushLoop, this);
+    }
+
+    // Buffer of the calling thread: an unowned, drained buffer if there is one, otherwise a new one.
+    LogBuffer* threadBuffer() {
+        static thread_local ThreadHandle handle;
+        if (handle.buffer != NULL) {
+            return handle.buffer;
+        }
+        std::lock_guard<std::mutex> guard(registryLock);
+        for (size_t i = 0; i < buffers.size(); i++) {
+            LogBuffer* buffer = buffers[i];
+            if (!buffer->owned.load(std::memory_order_acquire)
+                && buffer->head.load() == buffer->tail.load(std::memory_order_acquire)) {
+                buffer->owned.store(true);
+                handle.buffer = buffer;
+                return buffer;
+            }
+        }
+        handle.buffer = new LogBuffer();
+        buffers.push_back(handle.buffer);
+        return handle.buffer;
+    }
+
+    void flushLoop() {
+        Platform::instance().enterThread(ThreadRole::Background);
+        while (running) {
+            flush();
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        }
+    }
+
+    std::atomic<int> minLevel;
+    std::atomic<bool> running;
+    std::chrono::steady_clock::time_point start;
+    std::mutex registryLock;
+    std::mutex flushLock;
+    std::vector<LogBuffer*> buffers;
+    std::thread flusher;
+};
+
+inline void logMessage(LogLevel level, const char* format, ...) {
+    Logger& logger = Logger::instance();
+    if (!logger.enabled(level)) {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    logger.log(level, format, args);
+    va_end(args);
+}
+
+#define LOG_DEBUG(...) logMessage(LogLevel::Debug, __VA_ARGS__)
+#define LOG_INFO(...) logMessage(LogLevel::Info, __VA_ARGS__)
+#define LOG_WARNING(...) logMessage(LogLevel::Warning, __VA_ARGS__)
+#define LOG_ERROR(...) logMessage(LogLevel::Error, __VA_ARGS__)
@@ -0,0 +1,286 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <math.h>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <iostream>
+#include "ControlServer.h"
+#include "IoStats.h"
+#include "Platform.h"
+#include "Snapshot.h"
+
+/*
+    Metrics of the magnet system for a Prometheus scraper, over HTTP on 127.0.0.1.
+    GET /metrics answers in the text exposition format: the rate of the control loop, the set-points
+    and readbacks of the power supplies, and per port the writes, errors and write latency quantiles.
+    A scrape never waits for the control loop or the I/O threads, nor they for it: the control loop
+    publishes a ControlSample into a SnapshotCell a few times per second, and the I/O counters are
+    atomics (see IoStats.h). The server has its own thread, which only reads both, so a slow or stuck
+    scraper costs the control loop nothing.
+*/
+
+// State of the control loop, published for the metrics server.
+struct ControlSample {
+    uint64_t iterations = 0;   // of the control loop since the start
+    double loopRate = 0;       // iterations per second over the last publish interval
+    double uptime = 0;         // seconds
+    float setpoints[3] = {};   // amps, of the X, Y and Z power supplies; lists report their last set-point
+    float readbacks[3] = { NAN, NAN, NAN }; // amps, NaN until read back
+    bool output[3] = {};
+    bool listMode[3] = {};
+    bool hopping = false;
+    float freq = 0;
+};
+
+class MetricsServer {
+public:
+    ~MetricsServer() {
+        stop();
+    }
+
+    // Serve GET /metrics on 127.0.0.1:port from a thread of its own. `control` is published by the
+    // control loop; `ports` are the counters of the X, Y and Z power supplies, named `names`.
+    bool start(int port, const SnapshotCell<ControlSample>* control, const std::shared_ptr<PortCounters> ports[3],
+        const std::string names[3]) {
+        if (!startSockets()) {
+            return false;
+        }
+        listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (listener == INVALID_SOCKET_HANDLE) {
+            return false;
+        }
+        int reuse = 1;
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse));
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_port = htons((unsigned short)port);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(listener, (sockaddr*)&address, sizeof(address)) != 0 || ::listen(listener, 4) != 0) {
+            closeSocket(listener);
+            listener = INVALID_SOCKET_HANDLE;
+            return false;
+        }
+        this->control = control;
+        for (int i = 0; i < 3; i++) {
+            this->ports[i] = ports[i];
+            this->names[i] = names[i];
+        }
+        running = true;
+        worker = std::thread(&MetricsServer::serve, this);
+        std::cout << "Serving metrics on http://127.0.0.1:" << port << "/metrics\n\n";
+        return true;
+    }
+
+    void stop() {
+        running = false;
+        if (worker.joinable()) {
+            worker.join();
+        }
+        if (listener != INVALID_SOCKET_HANDLE) {
+            closeSocket(listener);
+            listener = INVALID_SOCKET_HANDLE;
+        }
+    }
+
+    // Metrics in the text exposition format.
+    std::string render() const {
+        std::string text;
+        char line[256];
+        SnapshotCell<ControlSample>::Snapshot sample = control->snapshot();
+        text += "# HELP magnets_uptime_seconds Seconds since the magnet system started.\n"
+            "# TYPE magnets_uptime_seconds gauge\n";
+        sprintf(line, "magnets_uptime_seconds %.3f\n", sample->uptime);
+        text += line;
+        text += "# HELP magnets_control_loop_iterations_total Iterations of the control loop.\n"
+            "# TYPE magnets_control_loop_iterations_total counter\n";
+        sprintf(line, "magnets_control_loop_iterations_total %llu\n", (unsigned long long)sample->iterations);
+        text += line;
+        text += "# HELP magnets_control_loop_rate_hertz Iterations of the control loop per second.\n"
+            "# TYPE magnets_control_loop_rate_hertz gauge\n";
+        sprintf(line, "magnets_control_loop_rate_hertz %.1f\n", sample->loopRate);
+        text += line;
+        text += "# HELP magnets_hopping Whether the field is hopping.\n# TYPE magnets_hopping gauge\n";
+        sprintf(line, "magnets_hopping %d\n", sample->hopping ? 1 : 0);
+        text += line;
+        text += "# HELP magnets_frequency_hertz Frequency of the rotation and hopping.\n"
+            "# TYPE magnets_frequency_hertz gauge\n";
+        sprintf(line, "magnets_frequency_hertz %g\n", sample->freq);
+        text += line;
+        gauges(&text, "magnets_setpoint_amperes", "Last current set-point sent to the power supply.", sample->setpoints);
+        gauges(&text, "magnets_readback_amperes", "Last output current read back from the power supply.", sample->readbacks);
+        float output[3];
+        float listMode[3];
+        for (int i = 0; i < 3; i++) {
+            output[i] = sample->output[i] ? 1.0f : 0.0f;
+            listMode[i] = sample->listMode[i] ? 1.0f : 0.0f;
+        }
+        gauges(&text, "magnets_output_on", "Whether the output of the power supply is on.", output);
+        gauges(&text, "magnets_list_mode", "Whether the power supply plays a list.", listMode);
+
+        PortStats stats[3];
+        for (int i = 0; i < 3; i++) {
+            stats[i] = ports[i]->query();
+        }
+        counters(&text, "magnets_writes_total", "Writes to the power supply.", stats, &PortStats::writes);
+        counters(&text, "magnets_written_bytes_total", "Bytes written to the power supply.", stats, &PortStats::bytes);
+        counters(&text, "magnets_read_errors_total", "Failed reads from the power supply.", stats, &PortStats::readErrors);
+        counters(&text, "magnets_saved_bytes_total", "Bytes not sent thanks to compact list encodings and list slots.",
+            stats, &PortStats::savedByEncoding, "by=\"encoding\"");
+        counters(&text, "magnets_saved_bytes_total", NULL, stats, &PortStats::savedBySlots, "by=\"slots\"");
+        text += "# HELP magnets_write_errors_total Failed writes to the power supply, by VISA status.\n"
+            "# TYPE magnets_write_errors_total counter\n";
+        for (int i = 0; i < 3; i++) {
+            for (int j = 0; j < IO_ERROR_CODES && stats[i].errorCounts[j] > 0; j++) {
+                sprintf(line, "magnets_write_errors_total{port=\"%s\",status=\"0x%08lX\"} %llu\n", names[i].c_str(),
+                    (unsigned long)stats[i].errorCodes[j], (unsigned long long)stats[i].errorCounts[j]);
+                text += line;
+            }
+            if (stats[i].otherErrors > 0) {
+                sprintf(line, "magnets_write_errors_total{port=\"%s\",status=\"other\"} %llu\n", names[i].c_str(),
+                    (unsigned long long)stats[i].otherErrors);
+                text += line;
+            }
+        }
+        text += "# HELP magnets_queue_depth Sends in progress on the port.\n# TYPE magnets_queue_depth gauge\n";
+        for (int i = 0; i < 3; i++) {
+            sprintf(line, "magnets_queue_depth{port=\"%s\"} %d\n", names[i].c_str(), stats[i].queueDepth);
+            text += line;
+        }
+        text += "# HELP magnets_write_latency_seconds Time of the writes to the power supply, quantiles as histogram bounds.\n"
+            "# TYPE magnets_write_latency_seconds summary\n";
+        const double quantiles[3] = { 0.5, 0.9, 0.99 };
+        for (int i = 0; i < 3; i++) {
+            for (int q = 0; q < 3; q++) {
+                sprintf(line, "magnets_write_latency_seconds{port=\"%s\",quantile=\"%g\"} %g\n", names[i].c_str(),
+                    quantiles[q], stats[i].latencyQuantile(quantiles[q]) / 1e6);
+                text += line;
+            }
+            sprintf(line, "magnets_write_latency_seconds_sum{port=\"%s\"} %g\n", names[i].c_str(), stats[i].latencySumUs / 1e6);
+            text += line;
+            sprintf(line, "magnets_write_latency_seconds_count{port=\"%s\"} %llu\n", names[i].c_str(),
+                (unsigned long long)stats[i].writes);
+            text += line;
+        }
+        return text;
+    }
+
+    // Scrapes answered.
+    std::atomic<uint64_t> scrapes{ 0 };
+
+private:
+    // One gauge per power supply.
+    void gauges(std::string* text, const char* name, const char* help, const float values[3]) const {
+        char line[256];
+        sprintf(line, "# HELP %s %s\n# TYPE %s gauge\n", name, help, name);
+        *text += line;
+        for (int i = 0; i < 3; i++) {
+            if (isnan(values[i])) {
+                sprintf(line, "%s{port=\"%s\"} NaN\n", name, names[i].c_str());
+            }
+            else {
+                sprintf(line, "%s{port=\"%s\"} %g\n", name, names[i].c_str(), values[i]);
+            }
+            *text += line;
+        }
+    }
+
+    // One counter per power supply, from a field of its stats. A NULL help continues the previous metric.
+    void counters(std::string* text, const char* name, const char* help, const PortStats stats[3],
+        uint64_t PortStats::*field, const char* label = NULL) const {
+        char line[256];
+        if (help != NULL) {
+            sprintf(line, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+            *text += line;
+        }
+        for (int i = 0; i < 3; i++) {
+            sprintf(line, "%s{port=\"%s\"%s%s} %llu\n", name, names[i].c_str(), label != NULL ? "," : "",
+                label != NULL ? label : "", (unsigned long long)(stats[i].*field));
+            *text += line;
+        }
+    }
+
+    // Accept scrapers one at a time until stopped, checking every 200 ms.
+    void serve() {
+        Platform::instance().enterThread(ThreadRole::Background);
+        while (running) {
+            fd_set readable;
+            FD_ZERO(&readable);
+            FD_SET(listener, &readable);
+            timeval timeout;
+            timeout.tv_sec = 0;
+            timeout.tv_usec = 200000;
+            if (select((int)listener + 1, &readable, NULL, NULL, &timeout) <= 0) {
+                continue;
+            }
+            SocketHandle client = accept(listener, NULL, NULL);
+            if (client == INVALID_SOCKET_HANDLE) {
+                continue;
+            }
+            answer(client);
+            closeSocket(client);
+        }
+    }
+
+    // Read the request line and headers, for at most a second, and answer it.
+    void answer(SocketHandle client) {
+        std::string request;
+        char data[1024];
+        std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+        while (request.find("\r\n\r\n") == std::string::npos && request.size() < 8192
+            && std::chrono::steady_clock::now() < end) {
+            fd_set readable;
+            FD_ZERO(&readable);
+            FD_SET(client, &readable);
+            timeval timeout;
+            timeout.tv_sec = 0;
+            timeout.tv_usec = 100000;
+            if (select((int)client + 1, &readable, NULL, NULL, &timeout) <= 0) {
+                continue;
+            }
+            int length = (int)recv(client, data, sizeof(data), 0);
+            if (length <= 0) {
+                return;
+            }
+            request.append(data, length);
+        }
+        // The path ends at the first space, or at the query string, which is ignored
+        std::string path;
+        if (request.compare(0, 4, "GET ") == 0) {
+            path = request.substr(4, request.find_first_of(" ?\r\n", 4) - 4);
+        }
+        std::string status = "200 OK";
+        std::string body;
+        if (path == "/metrics") {
+            body = render();
+            scrapes++;
+        }
+        else {
+            status = "404 Not Found";
+            body = "Metrics are at /metrics\n";
+        }
+        char header[160];
+        sprintf(header, "HTTP/1.1 %s\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n"
+            "Connection: close\r\n\r\n", status.c_str(), body.size());
+        std::string response = header + body;
+        size_t sent = 0;
+        while (sent < response.size()) {
+            int length = sendSocket(client, response.data() + sent, response.size() - sent);
+            if (length <= 0) {
+                return;
+            }
+            sent += length;
+        }
+    }
+
+    SocketHandle listener = INVALID_SOCKET_HANDLE;
+    const SnapshotCell<ControlSample>* control = NULL;
+    std::shared_ptr<PortCounters> ports[3];
+    std::string names[3];
+    std::atomic<bool> running{ false };
+    std::thread worker;
+};
@@ -0,0 +1,237 @@
+#pragma once
+
+#include <stdio.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <iostream>
+
+#ifdef _WIN32
+#include <Windows.h>
+#include <mmsystem.h>
+#include <timeapi.h>
+#pragma comment(lib, "winmm.lib")
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#endif
+
+/*
+    Scheduling of the threads of the magnet system.
+    Every thread announces its role when it starts (see Platform::enterThread()). With real-time
+    scheduling on, the I/O threads writing to the power supplies run above the input thread running
+    the control loop, and that one above the planning threads: SCHED_FIFO on Linux, a high priority
+    class with raised thread priorities on Windows, where the timer resolution is also set to 1 ms so
+    sleeps do not round up to the 15.6 ms tick. Each role can be pinned to a core, and the memory of the
+    process locked so a page fault never stalls a write. Settings the OS refuses (e.g. without the
+    privilege for real-time scheduling) are reported once and skipped.
+    Service threads, like the log flusher and the metrics server, take the background role: back to
+    normal scheduling on any core, whatever the thread that started them runs with. The control loop
+    calls idle() between polls, so with real-time scheduling it does not keep its core to itself.
+    The achieved wake-up jitter is measured at startup with measureWakeJitter().
+*/
+
+enum class ThreadRole {
+    Input,      // the control loop polling the controller, and the position feeds
+    Planning,   // waveform encoding and position control
+    Io,         // writes to one power supply
+    Background  // logging and metrics, below all of the above
+};
+
+struct PlatformSettings {
+    bool realtime = false;
+    bool lockMemory = false;
+    int inputCore = -1;              // -1 for any core
+    int planningCore = -1;
+    int ioCores[3] = { -1, -1, -1 }; // of the X, Y and Z power supplies
+};
+
+// Lateness of periodic wake-ups, in ms.
+struct JitterReport {
+    int wakeups = 0;
+    double mean = 0;
+    double p99 = 0;
+    double max = 0;
+
+    void report(double periodMs) const {
+        printf("Wake-up jitter at %.1f ms: mean %.3f ms, p99 %.3f ms, max %.3f ms late (%d wake-ups)\n\n",
+            periodMs, mean, p99, max, wakeups);
+    }
+};
+
+class Platform {
+public:
+    // The platform settings shared by the whole process.
+    static Platform& instance() {
+        static Platform platform;
+        return platform;
+    }
+
+    ~Platform() {
+#ifdef _WIN32
+        if (timerPeriodSet) {
+            timeEndPeriod(1);
+        }
+#endif
+    }
+
+    // Apply the process-wide settings. Called once at startup, from the input thread.
+    void configure(const PlatformSettings& settings) {
+        this->settings = settings;
+#ifdef _WIN32
+        timerPeriodSet = timeBeginPeriod(1) == TIMERR_NOERROR;
+        if (settings.realtime && !SetPriorityClass(GetCurrentProcess(), HIGH_PRIORITY_CLASS)) {
+            warn(Warning::Priority, "Cannot raise the priority class of the process");
+        }
+        if (settings.lockMemory) {
+            // Keep the working set resident: at least 64 MB, which covers the buffers of the system
+            SIZE_T minimum = 64 << 20;
+            if (!SetProcessWorkingSetSize(GetCurrentProcess(), minimum, minimum * 4)) {
+                warn(Warning::Memory, "Cannot lock the working set in memory");
+            }
+        }
+#else
+        if (settings.lockMemory && mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+            warn(Warning::Memory, "Cannot lock the memory of the process (needs CAP_IPC_LOCK or a higher RLIMIT_MEMLOCK)");
+        }
+#endif
+        saveCores();
+        enterThread(ThreadRole::Input);
+    }
+
+    // Set the priority and core of the calling thread for its role. axis is 0, 1 or 2 for I/O threads.
+    void enterThread(ThreadRole role, int axis = 0) {
+        if (role == ThreadRole::Background) {
+            enterBackground();
+            return;
+        }
+        int core = role == ThreadRole::Input ? settings.inputCore
+            : (role == ThreadRole::Planning ? settings.planningCore : settings.ioCores[axis < 0 || axis > 2 ? 0 : axis]);
+        if (core >= 0 && !pin(core)) {
+            warn(Warning::Pin, "Cannot pin a thread to core " + std::to_string(core));
+        }
+        if (settings.realtime && !raisePriority(role)) {
+            warn(Warning::Priority, "Cannot set real-time scheduling (needs CAP_SYS_NICE or root)");
+        }
+    }
+
+    // Sleep `samples` times for `periodMs` to absolute deadlines, and measure how late each wake-up was.
+    JitterReport measureWakeJitter(double periodMs, int samples) const {
+        std::vector<double> lateness;
+        std::chrono::steady_clock::duration period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double, std::milli>(periodMs));
+        std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now();
+        for (int i = 0; i < samples; i++) {
+            deadline += period;
+            std::this_thread::sleep_until(deadline);
+            lateness.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - deadline).count());
+        }
+        JitterReport report;
+        if (lateness.empty()) {
+            return report;
+        }
+        std::sort(lateness.begin(), lateness.end());
+        report.wakeups = (int)lateness.size();
+        for (size_t i = 0; i < lateness.size(); i++) {
+            report.mean += lateness[i] / lateness.size();
+        }
+        report.p99 = lateness[(size_t)(0.99 * (lateness.size() - 1))];
+        report.max = lateness.back();
+        return report;
+    }
+
+    const PlatformSettings& current() const {
+        return settings;
+    }
+
+    // Called by the control loop between polls: with real-time scheduling, give the core to the threads
+    // below it for a moment, since a polling loop at real-time priority would starve them.
+    void idle() const {
+        if (settings.realtime) {
+            std::this_thread::sleep_for(std::chrono::microseconds(500));
+        }
+    }
+
+private:
+    Platform() {
+    }
+
+    bool pin(int core) {
+#ifdef _WIN32
+        return core < 64 && SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << core) != 0;
+#else
+        cpu_set_t cores;
+        CPU_ZERO(&cores);
+        CPU_SET(core, &cores);
+        return pthread_setaffinity_np(pthread_self(), sizeof(cores), &cores) == 0;
+#endif
+    }
+
+    // Remember the cores the process may run on, before the calling thread is pinned.
+    void saveCores() {
+#ifdef _WIN32
+        DWORD_PTR system;
+        coresSaved = GetProcessAffinityMask(GetCurrentProcess(), &processCores, &system) != 0;
+#else
+        coresSaved = sched_getaffinity(0, sizeof(processCores), &processCores) == 0;
+#endif
+    }
+
+    // Normal scheduling on any core of the process, undoing what the thread inherited from its creator.
+    void enterBackground() {
+#ifdef _WIN32
+        if (coresSaved) {
+            SetThreadAffinityMask(GetCurrentThread(), processCores);
+        }
+        SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_NORMAL);
+#else
+        if (coresSaved) {
+            pthread_setaffinity_np(pthread_self(), sizeof(processCores), &processCores);
+        }
+        sched_param parameters = {};
+        pthread_setschedparam(pthread_self(), SCHED_OTHER, &parameters);
+#endif
+    }
+
+    // I/O threads above the input thread, which is above planning
+    bool raisePriority(ThreadRole role) {
+#ifdef _WIN32
+        int priority = role == ThreadRole::Io ? THREAD_PRIORITY_TIME_CRITICAL
+            : (role == ThreadRole::Input ? THREAD_PRIORITY_HIGHEST : THREAD_PRIORITY_ABOVE_NORMAL);
+        return SetThreadPriority(GetCurrentThread(), priority) != 0;
+#else
+        sched_param parameters = {};
+        parameters.sched_priority = role == ThreadRole::Io ? 80 : (role == ThreadRole::Input ? 70 : 60);
+        return pthread_setschedparam(pthread_self(), SCHED_FIFO, &parameters) == 0;
+#endif
+    }
+
+    enum Warning {
+        Pin,
+        Priority,
+        Memory,
+        WARNINGS
+    };
+
+    // Print each kind of warning once, since a thread is started for every command.
+    void warn(Warning kind, const std::string& message) {
+        if (warned[kind].exchange(true)) {
+            return;
+        }
+        std::cout << message << "; continuing without it\n\n";
+    }
+
+    PlatformSettings settings;
+    std::atomic<bool> warned[WARNINGS] = {};
+    bool coresSaved = false;
+#ifdef _WIN32
+    bool timerPeriodSet = false;
+    DWORD_PTR processCores = 0;
+#else
+    cpu_set_t processCores;
+#endif
+};
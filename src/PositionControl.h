@@ -0,0 +1,337 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <iostream>
+#include "ControlServer.h"
+#include "Platform.h"
+#include "Timing.h"
+
+/*
+    Closed-loop control of the particle position.
+    Positions measured by an external tracker come in on a PositionFeed: UDP datagrams on the
+    loopback interface, or lines appended to a file or pipe. A PositionController runs one PID
+    controller per axis at a fixed rate on its own thread and publishes the resulting currents as
+    the latest set-point. The caller sends the set-points to the power supplies at the pace of the
+    serial links, so a slow write never delays the control loop; set-points it could not send in
+    time are replaced by newer ones.
+*/
+
+struct PositionSample {
+    float position[3];
+    std::chrono::steady_clock::time_point time;
+    uint64_t sequence = 0; // 0 until the first measurement arrives
+};
+
+// Latest position reported by the tracker.
+class PositionFeed {
+public:
+    ~PositionFeed() {
+        close();
+    }
+
+    // Open "udp:<port>" or a file path. UDP datagrams hold three little-endian f32 or the text
+    // "x y z"; files hold one "x y z" line per measurement and are followed like tail -f.
+    bool open(const std::string& source) {
+        close();
+        running = true;
+        if (source.compare(0, 4, "udp:") == 0) {
+            if (!openUdp(atoi(source.c_str() + 4))) {
+                return false;
+            }
+            reader = std::thread(&PositionFeed::readUdp, this);
+        }
+        else {
+            file.open(source.c_str());
+            if (!file) {
+                std::cout << "Cannot open position feed " << source << "\n\n";
+                return false;
+            }
+            reader = std::thread(&PositionFeed::readFile, this);
+        }
+        std::cout << "Reading positions from " << source << "\n\n";
+        return true;
+    }
+
+    void close() {
+        running = false;
+        if (reader.joinable()) {
+            reader.join();
+        }
+        if (socket != INVALID_SOCKET_HANDLE) {
+            closeSocket(socket);
+            socket = INVALID_SOCKET_HANDLE;
+        }
+        file.close();
+    }
+
+    PositionSample latest() {
+        std::lock_guard<std::mutex> guard(lock);
+        return sample;
+    }
+
+private:
+    bool openUdp(int port) {
+        if (!startSockets()) {
+            return false;
+        }
+        socket = ::socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_port = htons((unsigned short)port);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (socket == INVALID_SOCKET_HANDLE || bind(socket, (sockaddr*)&address, sizeof(address)) != 0) {
+            std::cout << "Cannot listen for positions on UDP port " << port << "\n\n";
+            return false;
+        }
+        return true;
+    }
+
+    void publish(const float position[3]) {
+        std::lock_guard<std::mutex> guard(lock);
+        memcpy(sample.position, position, sizeof(sample.position));
+        sample.time = std::chrono::steady_clock::now();
+        sample.sequence++;
+    }
+
+    void readUdp() {
+        Platform::instance().enterThread(ThreadRole::Input);
+        char data[256];
+        while (running) {
+            fd_set readable;
+            FD_ZERO(&readable);
+            FD_SET(socket, &readable);
+            timeval timeout = { 0, 100000 };
+            if (select((int)socket + 1, &readable, NULL, NULL, &timeout) <= 0) {
+                continue;
+            }
+            int length = (int)recv(socket, data, sizeof(data) - 1, 0);
+            float position[3] = {};
+            if (length == 12) {
+                for (int i = 0; i < 3; i++) {
+                    position[i] = getF32((const unsigned char*)data + 4 * i);
+                }
+                publish(position);
+            }
+            else if (length > 0) {
+                data[length] = '\0';
+                // A measurement without all three axes is dropped, rather than controlling a missing axis to 0
+                if (sscanf(data, "%f %f %f", &position[0], &position[1], &position[2]) == 3) {
+                    publish(position);
+                }
+            }
+        }
+    }
+
+    void readFile() {
+        Platform::instance().enterThread(ThreadRole::Input);
+        std::string line;
+        std::string partial; // start of a line the tracker has not finished writing
+        while (running) {
+            if (!std::getline(file, line) || file.eof()) {
+                // Wait for the tracker to append more lines, keeping the text of an unfinished one
+                partial += line;
+                line.clear();
+                file.clear();
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                continue;
+            }
+            if (!partial.empty()) {
+                line = partial + line;
+                partial.clear();
+            }
+            float position[3] = {};
+            if (sscanf(line.c_str(), "%f %f %f", &position[0], &position[1], &position[2]) == 3) {
+                publish(position);
+            }
+        }
+    }
+
+    std::atomic<bool> running{ false };
+    std::thread reader;
+    SocketHandle socket = INVALID_SOCKET_HANDLE;
+    std::ifstream file;
+    std::mutex lock;
+    PositionSample sample;
+};
+
+// PID controller of one axis, with the integral clamped so the output cannot wind up past its limit.
+struct Pid {
+    float kp = 1;
+    float ki = 0;
+    float kd = 0;
+    float limit = 1; // largest output magnitude
+    float integral = 0;
+    float lastError = 0;
+    bool first = true;
+
+    float update(float error, float dt) {
+        float derivative = first ? 0 : (error - lastError) / dt;
+        first = false;
+        lastError = error;
+        if (ki != 0) {
+            integral += error * dt;
+            float bound = limit / fabs(ki);
+            integral = integral > bound ? bound : (integral < -bound ? -bound : integral);
+        }
+        float output = kp * error + ki * integral + kd * derivative;
+        return output > limit ? limit : (output < -limit ? -limit : output);
+    }
+
+    void reset() {
+        integral = 0;
+        lastError = 0;
+        first = true;
+    }
+};
+
+// Timing of a periodic loop: the period between wake-ups and how late each wake-up was.
+struct LoopStats {
+    uint64_t iterations = 0;
+    uint64_t overruns = 0; // wake-ups later than a whole period
+    double periodSum = 0;
+    double periodSquares = 0;
+    double minPeriod = 1e9;
+    double maxPeriod = 0;
+    double maxLateness = 0;
+
+    void add(double period, double lateness, double target) {
+        iterations++;
+        periodSum += period;
+        periodSquares += period * period;
+        minPeriod = period < minPeriod ? period : minPeriod;
+        maxPeriod = period > maxPeriod ? period : maxPeriod;
+        maxLateness = lateness > maxLateness ? lateness : maxLateness;
+        if (lateness > target) {
+            overruns++;
+        }
+    }
+
+    void report(const std::string& name, double target) const {
+        if (iterations == 0) {
+            std::cout << name << ": no iterations\n";
+            return;
+        }
+        double mean = periodSum / iterations;
+        double deviation = sqrt(fabs(periodSquares / iterations - mean * mean));
+        printf("%s: %llu iterations, period %.3f ms (target %.3f), jitter %.3f ms std, min %.3f, max %.3f, "
+            "max lateness %.3f ms, %llu overruns\n", name.c_str(), (unsigned long long)iterations, mean * 1e3,
+            target * 1e3, deviation * 1e3, minPeriod * 1e3, maxPeriod * 1e3, maxLateness * 1e3,
+            (unsigned long long)overruns);
+    }
+};
+
+class PositionController {
+public:
+    PositionController(PositionFeed* feed, double rateHz) : feed(feed), period(1 / rateHz) {
+    }
+
+    ~PositionController() {
+        stop();
+    }
+
+    // Target position, in the units of the tracker.
+    float target[3] = {};
+    // Controllers of x, y and z; their limits bound the set-point currents.
+    Pid pid[3];
+    // Measurements older than this many seconds are not used; the set-point goes to zero.
+    double maxSampleAge = 0.25;
+    LoopStats stats;
+
+    void start() {
+        running = true;
+        worker = std::thread(&PositionController::loop, this);
+    }
+
+    void stop() {
+        running = false;
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+
+    double targetPeriod() const {
+        return period;
+    }
+
+    // Latest set-point in amps. Returns false if no new set-point was published since `sequence`,
+    // which is updated otherwise.
+    bool setpoint(float currents[3], uint64_t* sequence) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (published == *sequence) {
+            return false;
+        }
+        memcpy(currents, output, sizeof(output));
+        *sequence = published;
+        return true;
+    }
+
+private:
+    // Wake up at fixed deadlines; a late wake-up does not shift the following deadlines.
+    void loop() {
+        std::chrono::steady_clock::duration step = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(period));
+        std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now();
+        std::chrono::steady_clock::time_point lastWake = deadline;
+        std::chrono::steady_clock::time_point lastUpdate = deadline;
+        uint64_t lastSample = 0;
+        Platform::instance().enterThread(ThreadRole::Planning);
+        bool stale = true;
+        while (running) {
+            deadline += step;
+            DeadlineTimer::instance().sleepUntil(deadline);
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            stats.add(std::chrono::duration<double>(now - lastWake).count(),
+                std::chrono::duration<double>(now - deadline).count(), period);
+            lastWake = now;
+
+            PositionSample sample = feed->latest();
+            if (sample.sequence == 0 || std::chrono::duration<double>(now - sample.time).count() > maxSampleAge) {
+                if (!stale) {
+                    for (int i = 0; i < 3; i++) {
+                        pid[i].reset();
+                    }
+                    float zero[3] = {};
+                    publish(zero);
+                    stale = true;
+                }
+                continue;
+            }
+            stale = false;
+            if (sample.sequence == lastSample) {
+                continue;
+            }
+            lastSample = sample.sequence;
+            // Measurements may come slower than the loop runs, so the time step is the one between updates
+            float dt = pid[0].first ? (float)period : std::chrono::duration<float>(now - lastUpdate).count();
+            lastUpdate = now;
+            float currents[3];
+            for (int i = 0; i < 3; i++) {
+                currents[i] = pid[i].update(target[i] - sample.position[i], dt);
+            }
+            publish(currents);
+        }
+    }
+
+    void publish(const float currents[3]) {
+        std::lock_guard<std::mutex> guard(lock);
+        memcpy(output, currents, sizeof(output));
+        published++;
+    }
+
+    PositionFeed* feed;
+    double period;
+    std::atomic<bool> running{ false };
+    std::thread worker;
+    std::mutex lock;
+    float output[3] = {};
+    uint64_t published = 0;
+};
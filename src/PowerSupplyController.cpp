@@ -1,13 +1,19 @@
 #if defined(_MSC_VER) && !defined(_CRT_SECURE_NO_DEPRECATE)
 #define _CRT_SECURE_NO_DEPRECATE
 #endif
+// Keep Windows.h from including winsock.h, which conflicts with the winsock2.h of ControlServer.h
+#if defined(_WIN32) && !defined(WIN32_LEAN_AND_MEAN)
+#define WIN32_LEAN_AND_MEAN
+#endif
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <string>
+#include <vector>
 #include <iostream>
 #include <chrono>
+#include <time.h>
 #include "visa.h"
 #include <thread>
 #include <Windows.h>
@@ -15,27 +21,133 @@
 #include <cmath>
 #include <math.h>
 #include <thread>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include "SessionManager.h"
+#include "DeviceDiscovery.h"
+#include "Transport.h"
+#include "ListEncoding.h"
+#include "Recorder.h"
+#include "Logger.h"
+#include "Replay.h"
+#include "ControlServer.h"
+#include "PositionControl.h"
+#include "CoilLimiter.h"
+#include "Config.h"
+#include "Sweep.h"
+#include "Joystick.h"
+#include "Snapshot.h"
+#include "Platform.h"
+#include "Timing.h"
+#include "IoStats.h"
+#include "Metrics.h"
+#include "Waveform.h"
+#include "CommandBuffer.h"
 
 #pragma comment(lib,"XInput.lib")
 #pragma comment(lib,"Xinput9_1_0.lib")
 #define M_PI 3.14159265358979323846
-#define NUM_STEPS 48
 
 
 
+/*
+    LUT index of sample i of the hopping waveform starting at LUT index `start`, for a LUT of `steps` entries.
+    The waveform has steps * 2 samples: a hold at start, a half turn, a hold at start + pi
+    and another half turn. Its direction is given by `start`.
+*/
+int hoppingIndex(int start, int i, int steps) {
+    if (i < steps / 2) {
+        return start;
+    }
+    else if (i < steps) {
+        return (start + i - steps / 2) % steps;
+    }
+    else if (i < steps * 3 / 2) {
+        return (start + steps / 2) % steps;
+    }
+    return (start + i - steps) % steps;
+}
+
 /*
     Class representing a power supply.
 */
 class PowerSupply {
 public:
+    // Axis of the power supply in the magnet system ('X', 'Y' or 'Z'), used in the recording
+    char axis = 0;
+
     // VISA session variables
-    ViSession defaultRM;
-    ViSession instr;
+    SessionHandle session;
     ViStatus status;
-    ViUInt32 retCount;
-    ViUInt32 writeCount;
-    unsigned char buffer[100];
-    char command[512];
+
+    // Last state sent to the power supply, replayed after a reconnect.
+    // List uploads and slot selections leave their start command pending in `startCommand`; the shadow
+    // state only takes them over once that command was executed.
+    CommandBuffer startCommand;
+    ShadowState shadow;
+    ShadowState pending;
+    bool pendingStart = false;
+    bool uploading = false;
+
+    // Error handling of the serial link
+    RetryPolicy retryPolicy;
+    RecoveryStats recovery;
+
+    // Running totals of the writes, readable from any thread (see IoStats.h). Shared, so the power
+    // supply stays movable and a reader may keep them after it is gone.
+    std::shared_ptr<PortCounters> io = std::make_shared<PortCounters>();
+
+    // Most compact list encoding supported by the power supply, found by probeListEncoding().
+    // The compact ASCII encoding uses as many decimals as the DAC resolves: 2 * fullScale / 2^dacBits,
+    // with dacBits from the settings (see Config::dacBits).
+    ListEncoding encoding = ListEncoding::LegacyAscii;
+    ListEncoding lastEncoding = ListEncoding::LegacyAscii;
+    bool compactSupported = false;
+    int dacBits = 12;
+    float fullScale = 0;
+    int listDecimals = 3;
+    UploadStats lastUpload;
+    UploadStats uploadTotals;
+
+    // Does the power supply take a dwell time per list point? Found by probeDwellList().
+    // maxDwell is the longest dwell time of a single point in seconds, maxListPoints the size of the list memory.
+    bool dwellListSupported = false;
+    float maxDwell = 10;
+    int maxListPoints = 1000;
+    bool lastCompressed = false;
+
+    // Points and dwell times of the last upload as the list memory should hold them, see verifyList().
+    // The dwell times have one entry unless holds were merged.
+    std::vector<float> uploadedPoints;
+    std::vector<float> uploadedDwells;
+    float verifyTolerance = 0; // amps; 0 for one step of the DAC
+    VerifyStats verifyStats;
+    // How late the start commands were written, against their scheduled time (see MagnetSystem::startSupplies())
+    DeadlineStats startTiming;
+
+    // Instrument-side list memory. Slots 1 to MAX_LIST_SLOTS are saved with *sav and restored with *rcl.
+    bool slotsSupported = false;
+    bool slotLoaded[MAX_LIST_SLOTS + 1] = {};
+    size_t slotBytes[MAX_LIST_SLOTS + 1] = {}; // size of the upload saved in each slot
+
+    // Thermal and slew-rate limits of the coil, applied to every set-point and list.
+    // The heat of a list is accounted for when it starts, from the mean square of the pending list.
+    CoilLimiter limiter;
+    double pendingSquare = 0;
+    float pendingFirst = 0;
+    double slotSquare[MAX_LIST_SLOTS + 1] = {};
+    float slotFirst[MAX_LIST_SLOTS + 1] = {};
+
+    // Simulated power supply for replays, opened with a "SIM::" descriptor: nothing is sent to an instrument.
+    bool simulated = false;
+    SimulatedLink simulation;
+
+    // Set if the VISA Resource Manager could not be opened, so nothing can be connected.
+    bool noResourceManager = false;
+    // Set once a session to the power supply is open.
+    bool connected = false;
 
     // Default constructor
     PowerSupply() {
@@ -44,40 +156,556 @@ public:
     // Constructor with descriptor, connecting the power supply to the computer. 
     // The descriptor contains the name of the port the power supply is connected to. 
     // E.g. "ASRL3::INSTR".
+    // The session comes from the shared SessionManager and is returned to its pool on destruction.
+    // Power supplies are connected concurrently, so a failure is left in `status` for the caller
+    // to handle instead of ending the process from a connecting thread.
     PowerSupply(const char* descriptor) {
-        status = viOpenDefaultRM(&this->defaultRM);
+        if (isSimulatedDescriptor(descriptor)) {
+            simulated = true;
+            session = SessionHandle(NULL, descriptor, VI_NULL);
+            status = VI_SUCCESS;
+            connected = true;
+            return;
+        }
+        status = SessionManager::instance().open();
         if (status < VI_SUCCESS) {
-            printf("Could not open a session to the VISA Resource Manager!\n\n");
-            exit(EXIT_FAILURE);
+            noResourceManager = true;
+            return;
         }
         std::cout << "Connecting to the device\n\n";
-        status = viOpen(this->defaultRM, descriptor, VI_NULL, VI_NULL, &this->instr);
-        if (status < VI_SUCCESS) {
-            printf("Cannot open a session to the device.\n\n");
+        status = SessionManager::instance().acquire(descriptor, 5000, &session);
+        connected = status >= VI_SUCCESS;
+    }
+
+    // A power supply owns its session, so it can be moved but not copied.
+    PowerSupply(PowerSupply&&) = default;
+    PowerSupply& operator=(PowerSupply&&) = default;
+    PowerSupply(const PowerSupply&) = delete;
+    PowerSupply& operator=(const PowerSupply&) = delete;
+
+    // Close the session and open it again, e.g. after the power supply browned out.
+    bool reconnect() {
+        LOG_WARNING("Reconnecting to %s", session.descriptor().c_str());
+        recovery.reconnects++;
+        status = session.reconnect(5000);
+        return status >= VI_SUCCESS;
+    }
+
+    // Write `length` bytes of `data` to the power supply without any error handling.
+    ViStatus write(const char* data, size_t length) {
+        std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+        ViUInt32 writeCount = 0;
+        ViStatus result = simulated ? simulation.write(length, &writeCount)
+            : viWrite(session.get(), (ViBuf)data, (ViUInt32)length, &writeCount);
+        io->recordWrite(result, result >= VI_SUCCESS ? writeCount : 0,
+            std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - begin).count());
+        return result;
+    }
+
+    ViStatus write(const char* text) {
+        return write(text, strlen(text));
+    }
+
+    // Send `command` to the power supply to execute. The buffer goes back to the pool once it was written.
+    // An empty command, which is what formatting a command too long for its buffer gives, is not sent.
+    void executeCommand(CommandBuffer command) {
+        if (command.empty()) {
+            LOG_ERROR("%s: empty or too long command, not sent", session.descriptor().c_str());
+            status = VI_ERROR_INV_LENGTH;
+            return;
         }
-        status = viSetAttribute(instr, VI_ATTR_TMO_VALUE, 5000);
+        send(command.data(), command.size());
     }
 
-    // Send the string stored in `command` to the power supply to execute.
+    // Send the pending start command, left by an upload or selectListSlot(). Once it was written, the
+    // shadow state takes over the state it starts. Nothing is sent if there is none, e.g. after an aborted upload.
     void executeCommand() {
-        status = viWrite(instr, (ViBuf)this->command, (ViUInt32)strlen(this->command), &this->writeCount);
+        if (!pendingStart) {
+            LOG_ERROR("%s: no list to start", session.descriptor().c_str());
+            status = VI_ERROR_INV_SETUP;
+            return;
+        }
+        executeCommand(std::move(startCommand));
+        if (status >= VI_SUCCESS && pendingStart) {
+            shadow = pending;
+            pendingStart = false;
+            limiter.startList(pendingSquare, pendingFirst);
+        }
+    }
+
+    // Send `length` bytes of `data`, which may contain binary blocks, to the power supply to execute.
+    // A failed write is retried as described in recover().
+    void send(const char* data, size_t length) {
+        io->enter();
+        status = write(data, length);
+        if (status < VI_SUCCESS) {
+            recover(data, length);
+        }
+        io->leave();
+        Recorder::instance().recordCommand(axis, data, length, status);
+    }
+
+    // Retry a failed command with bounded exponential backoff, for at most retryPolicy.maxTotalMs.
+    // Timeouts are retried once before reconnecting. After a reconnect the shadow state is replayed
+    // before the command is sent again, since the power supply may have been reset.
+    void recover(const char* data, size_t length) {
+        std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+        ErrorClass errorClass = classifyStatus(status);
+        recovery.failures++;
+        LOG_ERROR("Error writing to %s: %s (status %ld)", session.descriptor().c_str(), errorClassName(errorClass), (long)status);
+        for (int attempt = 1; attempt < retryPolicy.maxAttempts && errorClass != ErrorClass::Fatal; attempt++) {
+            double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+            if (elapsed + retryPolicy.backoffMs(attempt) > retryPolicy.maxTotalMs) {
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(retryPolicy.backoffMs(attempt)));
+            bool reopen = errorClass == ErrorClass::ConnectionLost || (errorClass == ErrorClass::Timeout && attempt > 1);
+            if (reopen && !(reconnect() && replayShadow())) {
+                errorClass = classifyStatus(status);
+                continue;
+            }
+            recovery.retries++;
+            status = write(data, length);
+            errorClass = classifyStatus(status);
+            if (status >= VI_SUCCESS) {
+                double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+                recovery.recordRecovery(ms);
+                LOG_INFO("Recovered %s after %.1f ms", session.descriptor().c_str(), ms);
+                return;
+            }
+        }
+        recovery.unrecovered++;
+        LOG_ERROR("Error writing to %s, giving up", session.descriptor().c_str());
+    }
+
+    // Bring a reconnected power supply back to the shadow state.
+    // An interrupted list upload is not replayed, because uploadList() starts it over.
+    bool replayShadow() {
+        if (!shadow.output) {
+            status = write("outp off\n");
+            return status >= VI_SUCCESS;
+        }
+        CommandBuffer text = CommandBuffer::format("func:mode curr;:volt %f\n", shadow.voltageLimit);
+        status = write(text.data(), text.size());
+        if (status < VI_SUCCESS) {
+            return false;
+        }
+        if (!shadow.listMode) {
+            text = CommandBuffer::format("curr %f;:outp on\n", shadow.current);
+        }
+        else if (shadow.slot > 0) {
+            text = CommandBuffer::format("*rcl %d;:outp on;:curr:mode list\n", shadow.slot);
+        }
+        else if (!uploading) {
+            ListEncoding chosen;
+            bool compressed;
+            std::vector<std::string> commands = shortestListCommands(shadow.list.data(), (int)shadow.list.size(),
+                shadow.voltageLimit, shadow.dwell, &chosen, &compressed);
+            for (size_t i = 0; i < commands.size() && status >= VI_SUCCESS; i++) {
+                status = write(commands[i].data(), commands[i].size());
+            }
+            text = CommandBuffer::format("list:coun %d;:outp on;:curr:mode list\n", shadow.count);
+        }
+        else {
+            return true;
+        }
+        status = status >= VI_SUCCESS ? write(text.data(), text.size()) : status;
+        return status >= VI_SUCCESS;
+    }
+
+    // Send `command` and read the response into `response`, at most `size` - 1 characters, zero-terminated.
+    // Returns false if the write or the read failed, or nothing was returned.
+    bool query(CommandBuffer command, char* response, size_t size, ViUInt32* length = NULL) {
+        ViUInt32 retCount = 0;
+        response[0] = 0;
+        executeCommand(std::move(command));
         if (status < VI_SUCCESS) {
-            std::cout << "Error writing to the device\n\n";
+            return false;
+        }
+        if (simulated) {
+            status = simulation.read(&retCount);
+            return false;
+        }
+        status = viRead(session.get(), (ViBuf)response, (ViUInt32)(size - 1), &retCount);
+        if (status < VI_SUCCESS) {
+            io->recordReadError();
+        }
+        response[status >= VI_SUCCESS ? retCount : 0] = 0;
+        if (length != NULL) {
+            *length = retCount;
+        }
+        return status >= VI_SUCCESS && retCount > 0;
+    }
+
+    // Send `command` and read the whole response, however long.
+    bool queryText(CommandBuffer command, std::string* response) {
+        char part[100];
+        ViUInt32 retCount = 0;
+        response->clear();
+        if (!query(std::move(command), part, sizeof(part), &retCount)) {
+            return false;
+        }
+        response->append(part, retCount);
+        while (status == VI_SUCCESS_MAX_CNT) {
+            status = viRead(session.get(), (ViBuf)part, sizeof(part) - 1, &retCount);
+            if (status < VI_SUCCESS) {
+                io->recordReadError();
+                return false;
+            }
+            response->append(part, retCount);
+        }
+        return true;
+    }
+
+    // Read back the list memory and compare it with the last upload: every current within the
+    // tolerance, and the dwell times within 0.1 % + 0.1 ms. A pending start command is kept for the caller.
+    // Returns false and logs the first difference if they do not match or cannot be read.
+    // Simulated power supplies have no list memory to read and always pass.
+    bool verifyList() {
+        if (simulated) {
+            return true;
+        }
+        std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+        float tolerance = verifyTolerance > 0 ? verifyTolerance
+            : (fullScale > 0 ? 2 * fullScale / (float)(1 << dacBits) : 1e-3f);
+        std::string response;
+        bool read = queryText(CommandBuffer::format("list:curr?\n"), &response);
+        std::vector<float> points = parseListResponse(response);
+        read = queryText(CommandBuffer::format("list:dwel?\n"), &response) && read;
+        std::vector<float> dwells = parseListResponse(response);
+
+        float maxError = 0;
+        int first = -1;
+        int mismatches = compareLists(uploadedPoints, points, tolerance, &maxError, &first);
+        float dwellError = 0;
+        int firstDwell = -1;
+        float longest = 0;
+        for (size_t i = 0; i < uploadedDwells.size(); i++) {
+            longest = uploadedDwells[i] > longest ? uploadedDwells[i] : longest;
+        }
+        int dwellMismatches = compareLists(uploadedDwells, dwells, longest * 1e-3f + 1e-4f, &dwellError, &firstDwell);
+        bool passed = read && mismatches == 0 && dwellMismatches == 0;
+
+        verifyStats.lists++;
+        verifyStats.failed += passed ? 0 : 1;
+        verifyStats.maxError = maxError > verifyStats.maxError ? maxError : verifyStats.maxError;
+        verifyStats.ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+        if (!read) {
+            LOG_WARNING("%s: cannot read back the list", session.descriptor().c_str());
+        }
+        else if (mismatches > 0) {
+            LOG_WARNING("%s: %d of %zu list points differ by more than %g A (read %zu points); first at %d: sent %g, read %g",
+                session.descriptor().c_str(), mismatches, uploadedPoints.size(), tolerance, points.size(), first,
+                first < (int)uploadedPoints.size() ? uploadedPoints[first] : NAN, first < (int)points.size() ? points[first] : NAN);
+        }
+        else if (dwellMismatches > 0) {
+            LOG_WARNING("%s: %d of %zu dwell times differ (read %zu); first at %d", session.descriptor().c_str(),
+                dwellMismatches, uploadedDwells.size(), dwells.size(), firstDwell);
+        }
+
+        return passed;
+    }
+
+    // Check whether the list is kept in the saved setups of the power supply.
+    // A two-point list is saved to `slot`, one the waveforms are about to be stored in, cleared and
+    // recalled; the probe succeeds only if the recalled list still has two points and the error queue is empty.
+    bool probeListSlots(int slot) {
+        char response[100];
+        executeCommand(CommandBuffer::format("*cls;:list:cle;:list:curr 0,0;*sav %d;:list:cle;*rcl %d\n", slot, slot));
+        slotsSupported = query(CommandBuffer::format("list:curr:poin?\n"), response, sizeof(response)) && atoi(response) == 2;
+        slotsSupported = query(CommandBuffer::format("syst:err?\n"), response, sizeof(response)) && atoi(response) == 0
+            && slotsSupported;
+        executeCommand(CommandBuffer::format("list:cle\n"));
+        memset(slotLoaded, 0, sizeof(slotLoaded));
+        return slotsSupported;
+    }
+
+    // Choose the most compact list encoding the power supply accepts.
+    // The full-scale current and the DAC resolution give the decimals of compact ASCII. Compact ASCII
+    // and binary blocks are each used only if a two-point list sent that way reads back within one
+    // step of the DAC.
+    ListEncoding probeListEncoding() {
+        char response[100];
+        encoding = ListEncoding::LegacyAscii;
+        compactSupported = false;
+        if (!query(CommandBuffer::format("curr? max\n"), response, sizeof(response))
+            || (fullScale = (float)atof(response)) <= 0) {
+            return encoding;
+        }
+        float step = 2 * fullScale / (float)(1 << dacBits);
+        listDecimals = decimalsForResolution(step);
+        // Values that need every decimal, so a supply rounding or misreading them is caught
+        const float probe[2] = { fullScale / 3, -fullScale / 7 };
+        if (probeEncoding(ListEncoding::CompactAscii, probe, step)) {
+            compactSupported = true;
+            encoding = ListEncoding::CompactAscii;
+        }
+        if (probeEncoding(ListEncoding::BinaryBlock, probe, step)) {
+            encoding = ListEncoding::BinaryBlock;
         }
-        memset(command, 0, 512 * sizeof(char));
+        executeCommand(CommandBuffer::format("*cls;:list:cle\n"));
+        return encoding;
+    }
+
+    // Send the two values of `probe` as a list in `listEncoding` and read them back.
+    // Returns true if both come back within `tolerance` amps.
+    bool probeEncoding(ListEncoding listEncoding, const float* probe, float tolerance) {
+        char response[100];
+        executeCommand(CommandBuffer::format("*cls;:list:cle\n"));
+        std::vector<std::string> commands = encodeListCommands(probe, 2, listEncoding, listDecimals);
+        for (size_t i = 0; i < commands.size(); i++) {
+            send(commands[i].data(), commands[i].size());
+        }
+        float first = 0;
+        float second = 0;
+        return query(CommandBuffer::format("list:curr?\n"), response, sizeof(response))
+            && sscanf(response, "%f,%f", &first, &second) == 2
+            && fabs(first - probe[0]) <= tolerance && fabs(second - probe[1]) <= tolerance;
+    }
+
+    // Save the list that was just uploaded to `slot`, replacing the pending start command.
+    // count: number of times to repeat the list when recalled; if 0, continue forever
+    void storeListSlot(int slot, int count) {
+        pendingStart = false;
+        startCommand.clear();
+        executeCommand(CommandBuffer::format("list:coun %d;*sav %d\n", count, slot));
+        slotLoaded[slot] = status >= VI_SUCCESS;
+        slotSquare[slot] = pendingSquare;
+        slotFirst[slot] = pendingFirst;
+        slotBytes[slot] = lastUpload.bytesOnWire;
+    }
+
+    // Prepare the command recalling the list saved in `slot` and starting it.
+    // Like the list uploads, the command is left in `startCommand` to be executed by the caller.
+    void selectListSlot(int slot) {
+        startCommand = CommandBuffer::format("*rcl %d;:outp on;:curr:mode list\n", slot);
+        pending = ShadowState();
+        pending.output = true;
+        pending.listMode = true;
+        pending.slot = slot;
+        pendingSquare = slotSquare[slot];
+        pendingFirst = slotFirst[slot];
+        pendingStart = true;
+        io->addSaved(SavedBy::Slots, slotBytes[slot]);
     }
 
     // Reset the power supply.
     void reset() {
-        std::cout << "Resetting the device\n\n";
-        strcpy(command, "*rst\n");
-        executeCommand();
+        LOG_INFO("Resetting %s", session.descriptor().c_str());
+        pendingStart = false;
+        startCommand.clear();
+        executeCommand(CommandBuffer::format("*rst\n"));
+        shadow = ShadowState();
+        limiter.stop();
     }
 
     // Set the current value and voltage limit of the power supply.
     void setCurrent(float current, float voltageLimit) {
-        sprintf(command, "func:mode curr;:curr %f;:volt %f;:outp on\n", current, voltageLimit);
-        executeCommand();
+        current = limiter.limitSetpoint(current);
+        pendingStart = false;
+        startCommand.clear();
+        executeCommand(CommandBuffer::format("func:mode curr;:curr %f;:volt %f;:outp on\n", current, voltageLimit));
+        shadow = ShadowState();
+        shadow.output = true;
+        shadow.voltageLimit = voltageLimit;
+        shadow.current = current;
+        Recorder::instance().recordSetpoint(axis, current);
+    }
+
+    // Lower a held set-point before the coil overheats, see CoilLimiter::tick(). Called periodically
+    // by the control loops, since a set-point may be held for as long as no new one arrives.
+    void limitHeldSetpoint() {
+        float current;
+        if (!shadow.output || shadow.listMode || !limiter.tick(&current)) {
+            return;
+        }
+        LOG_WARNING("%s: held set-point lowered to %.3f A to the coil limits", session.descriptor().c_str(), current);
+        executeCommand(CommandBuffer::format("curr %f\n", current));
+        shadow.current = current;
+        Recorder::instance().recordSetpoint(axis, current);
+    }
+
+    // Measure the output current and record it. Returns NAN if the query failed.
+    float readCurrent() {
+        char response[100];
+        if (!query(CommandBuffer::format("meas:curr?\n"), response, sizeof(response))) {
+            return NAN;
+        }
+        float current = (float)atof(response);
+        Recorder::instance().recordReadback(axis, current);
+        return current;
+    }
+
+    // Check whether the power supply takes one dwell time per list point.
+    bool probeDwellList() {
+        char response[100];
+        executeCommand(CommandBuffer::format("*cls;:list:cle;:list:dwel 0.01,0.02\n"));
+        dwellListSupported = query(CommandBuffer::format("list:dwel:poin?\n"), response, sizeof(response))
+            && atoi(response) == 2;
+        executeCommand(CommandBuffer::format("*cls;:list:cle\n"));
+        return dwellListSupported;
+    }
+
+    // Build the commands uploading a list: the header clearing the list memory, followed by the
+    // values. The list has to be broken up into smaller parts because the length of the command is limited.
+    // If compressHolds is set, repeated values are merged and followed by a dwell time per point.
+    std::vector<std::string> listCommands(const float* currentList, int length, float voltageLimit, float dwell,
+        ListEncoding listEncoding, bool compress) const {
+        char text[512];
+        std::vector<float> points;
+        std::vector<float> dwells;
+        if (compress) {
+            compressHolds(currentList, length, dwell, maxDwell, &points, &dwells);
+        }
+        if (compress && points.size() < (size_t)length) {
+            sprintf(text, "list:cle;:func:mode curr;:volt %f\n", voltageLimit);
+            std::vector<std::string> commands(1, text);
+            std::vector<std::string> values = encodeListCommands(points.data(), (int)points.size(), listEncoding, listDecimals);
+            std::vector<std::string> times = encodeDwellCommands(dwells);
+            commands.insert(commands.end(), values.begin(), values.end());
+            commands.insert(commands.end(), times.begin(), times.end());
+            return commands;
+        }
+        sprintf(text, "list:cle;:list:dwel %f;:func:mode curr;:volt %f\n", dwell, voltageLimit);
+        std::vector<std::string> commands(1, text);
+        std::vector<std::string> values = encodeListCommands(currentList, length, listEncoding, listDecimals);
+        commands.insert(commands.end(), values.begin(), values.end());
+        return commands;
+    }
+
+    // Encode a list with each encoding the power supply supports and return the shortest commands.
+    // Compact ASCII can beat binary blocks for lists with many round values, like the z list.
+    // Merging holds halves the points of the hopping list, but every remaining point then needs its own
+    // dwell time, which is often longer on the wire than the values it saves. Holds are therefore merged
+    // when that is shorter, or when the list would not fit the list memory otherwise.
+    std::vector<std::string> shortestListCommands(const float* currentList, int length, float voltageLimit, float dwell,
+        ListEncoding* chosen, bool* compressed) const {
+        std::vector<ListEncoding> encodings(1, encoding);
+        if (encoding == ListEncoding::BinaryBlock && compactSupported) {
+            encodings.push_back(ListEncoding::CompactAscii);
+        }
+        std::vector<std::string> shortest;
+        for (int compress = 0; compress <= (dwellListSupported ? 1 : 0); compress++) {
+            if (!compress && dwellListSupported && length > maxListPoints) {
+                continue;
+            }
+            for (size_t i = 0; i < encodings.size(); i++) {
+                std::vector<std::string> commands = listCommands(currentList, length, voltageLimit, dwell, encodings[i], compress != 0);
+                if (shortest.empty() || commandBytes(commands) < commandBytes(shortest)) {
+                    shortest = commands;
+                    *chosen = encodings[i];
+                    *compressed = compress != 0;
+                }
+            }
+        }
+        return shortest;
+    }
+
+    // Encode a list in the shortest commands for this power supply, without sending anything.
+    // Only reads settings found by the probes, so it may run on another thread during an upload.
+    PreparedList prepareList(const float* currentList, int length, float voltageLimit, float dwell, int count) const {
+        PreparedList list;
+        list.values.assign(currentList, currentList + length);
+        list.voltageLimit = voltageLimit;
+        list.dwell = dwell;
+        list.count = count;
+        list.commands = shortestListCommands(currentList, length, voltageLimit, dwell, &list.encoding, &list.compressed);
+        list.points = length;
+        if (list.compressed) {
+            std::vector<float> points;
+            std::vector<float> dwells;
+            compressHolds(currentList, length, dwell, maxDwell, &points, &dwells);
+            list.points = (int)points.size();
+        }
+        list.legacyBytes = commandBytes(listCommands(currentList, length, voltageLimit, dwell, ListEncoding::LegacyAscii, false));
+        return list;
+    }
+
+    // Upload a list and leave the command starting it in `startCommand`.
+    void uploadList(const float* currentList, int length, float voltageLimit, float dwell, int count) {
+        uploadPreparedList(prepareList(currentList, length, voltageLimit, dwell, count));
+    }
+
+    // Upload a prepared list and leave the command starting it in `startCommand`.
+    // A list the coil cannot carry is scaled down and encoded again.
+    // If the session had to be reopened during the upload, the upload starts over once. A command that
+    // cannot be recovered aborts the upload, leaving no start command, rather than waiting for every
+    // remaining command to fail in turn.
+    void uploadPreparedList(const PreparedList& prepared) {
+        std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+        const PreparedList* list = &prepared;
+        PreparedList limited;
+        int length = (int)prepared.values.size();
+        float scale = limiter.listScale(prepared.values.data(), length, prepared.dwell, prepared.count, &pendingSquare);
+        pendingFirst = length > 0 ? prepared.values[0] * scale : 0;
+        if (scale < 1) {
+            std::vector<float> values = prepared.values;
+            for (int i = 0; i < length; i++) {
+                values[i] *= scale;
+            }
+            limited = prepareList(values.data(), length, prepared.voltageLimit, prepared.dwell, prepared.count);
+            list = &limited;
+            LOG_WARNING("%s: list scaled by %.3f to the coil limits", session.descriptor().c_str(), scale);
+        }
+        const std::vector<std::string>& commands = list->commands;
+        lastEncoding = list->encoding;
+        lastCompressed = list->compressed;
+        uploading = true;
+        pendingStart = false;
+        startCommand.clear();
+        bool aborted = false;
+        for (int attempt = 0; attempt < 2 && !aborted; attempt++) {
+            int reconnects = recovery.reconnects;
+            for (size_t i = 0; i < commands.size() && !aborted; i++) {
+                if (lastEncoding == ListEncoding::BinaryBlock && commands[i].compare(0, 11, "list:curr #") == 0) {
+                    LOG_DEBUG("list:curr <binary block>");
+                }
+                else {
+                    LOG_DEBUG("%s", commands[i].c_str());
+                }
+                send(commands[i].data(), commands[i].size());
+                aborted = status < VI_SUCCESS;
+            }
+            if (recovery.reconnects == reconnects) {
+                break;
+            }
+        }
+        uploading = false;
+        if (aborted) {
+            LOG_ERROR("%s: list upload aborted", session.descriptor().c_str());
+            return;
+        }
+        lastUpload = UploadStats();
+        lastUpload.samples = length;
+        lastUpload.points = list->points;
+        lastUpload.commands = (int)commands.size();
+        lastUpload.bytesOnWire = commandBytes(commands);
+        lastUpload.legacyBytes = list->legacyBytes;
+        lastUpload.ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+        uploadTotals.add(lastUpload);
+        if (lastUpload.legacyBytes > lastUpload.bytesOnWire) {
+            io->addSaved(SavedBy::Encoding, lastUpload.legacyBytes - lastUpload.bytesOnWire);
+        }
+        if (lastCompressed) {
+            compressHolds(list->values.data(), length, list->dwell, maxDwell, &uploadedPoints, &uploadedDwells);
+        }
+        else {
+            uploadedPoints = list->values;
+            uploadedDwells.assign(1, list->dwell);
+        }
+        LOG_DEBUG("%s: %d samples as %d points in %d commands, %zu bytes (%zu legacy), %s, %.3f ms",
+            session.descriptor().c_str(), lastUpload.samples, lastUpload.points, lastUpload.commands, lastUpload.bytesOnWire,
+            lastUpload.legacyBytes, listEncodingName(lastEncoding), lastUpload.ms);
+        pending = ShadowState();
+        pending.output = true;
+        pending.listMode = true;
+        pending.voltageLimit = list->voltageLimit;
+        pending.list = list->values;
+        pending.dwell = list->dwell;
+        pending.count = list->count;
+        pendingStart = true;
+        startCommand = CommandBuffer::format("list:coun %d;:outp on;:curr:mode list\n", list->count);
+        LOG_DEBUG("%s", startCommand.data());
     }
 
     // Send a list of current values to the power supply.
@@ -86,27 +714,8 @@ public:
     //     length: number of entries in the array
     //     dwell: time in seconds to wait between each current value
     //     count: number of times to repeat the list; if 0, continue forever
-    void setCurrentList(float* currentList, int length, float voltageLimit, float dwell, int count) {
-        sprintf(command, "list:cle;:list:dwel %f;:func:mode curr;:volt %f\n", dwell, voltageLimit);
-        std::cout << command;
-        executeCommand();
-        // The list has to be broken up into smaller parts because the length of the command is limited.
-        for (int i = 0; i < length; i++) {
-            if (i % 8 == 0) {
-                strcpy(command, "list:curr ");
-            }
-            strcat(command, std::to_string(currentList[i]).substr(0, 5).c_str());
-            if (i % 8 != 7 && i != length - 1) {
-                strcat(command, ",");
-            }
-            else {
-                strcat(command, "\n");
-                std::cout << command;
-                executeCommand();
-            }
-        }
-        sprintf(command, "list:coun %d;:outp on;:curr:mode list\n", count);
-        std::cout << command;
+    void setCurrentList(const float* currentList, int length, float voltageLimit, float dwell, int count) {
+        uploadList(currentList, length, voltageLimit, dwell, count);
     }
 
     // Send a list of current values to the power supply, creating a waveform that causes the hopping motion.
@@ -114,42 +723,37 @@ public:
     // then stays at theta + pi for T/2, then goes to theta + 2pi in T/2.
     // Parameters:
     //     LUT: Lookup table for sine OR cosine funtions
+    //     steps: number of entries of the LUT
     //     count: number of times to repeat the waveform; if 0, continue forever
     //     start: starting index of the LUT, corresponding to the starting angle and the direction of the hopping motion
-    void setHoppingCurrentList(float* LUT, float voltageLimit, float dwell, int count, int start) {
-        sprintf(command, "list:cle;:list:dwel %f;:func:mode curr;:volt %f\n", dwell, voltageLimit);
-        std::cout << command;
-        executeCommand();
-        for (int i = 0; i < NUM_STEPS * 2; i++) {
-            if (i % 8 == 0) {
-                strcpy(command, "list:curr ");
-            }
-            if (i < NUM_STEPS / 2) {
-                strcat(command, std::to_string(LUT[start]).substr(0, 5).c_str());
-            }
-            else if (i < NUM_STEPS) {
-                strcat(command, std::to_string(LUT[(start + i - NUM_STEPS / 2) % NUM_STEPS]).substr(0, 5).c_str());
-            }
-            else if (i < NUM_STEPS * 3 / 2) {
-                strcat(command, std::to_string(LUT[(start + NUM_STEPS / 2) % NUM_STEPS]).substr(0, 5).c_str());
-            }
-            else {
-                strcat(command, std::to_string(LUT[(start + i - NUM_STEPS) % NUM_STEPS]).substr(0, 5).c_str());
-            }
-            if (i % 8 != 7 && i != NUM_STEPS * 2 - 1) {
-                strcat(command, ",");
-            }
-            else {
-                strcat(command, "\n");
-                std::cout << command;
-                executeCommand();
-            }
+    //     offset: sample of the waveform the list starts at, used to continue from the current phase
+    void setHoppingCurrentList(const float* LUT, int steps, float voltageLimit, float dwell, int count, int start, int offset = 0) {
+        std::vector<float> currentList(steps * 2);
+        for (int i = 0; i < steps * 2; i++) {
+            currentList[i] = LUT[hoppingIndex(start, (i + offset) % (steps * 2), steps)];
         }
-        sprintf(command, "list:coun %d;:outp on;:curr:mode list\n", count);
-        std::cout << command;
+        uploadList(currentList.data(), steps * 2, voltageLimit, dwell, count);
     }
 };
 
+// Waveform settings the I/O threads of the magnet system read, published by the control loop.
+struct WaveformParameters {
+    float zCurrent = 0;
+    float xyCurrent = 0;
+    float freq = 1;
+    float voltageLimit = 0;
+    int steps = NUM_STEPS;
+    double skewMs = 57;
+    double timeScale = 1;
+};
+
+// Lookup tables of the waveforms, published with the parameters they were computed from.
+struct WaveformTables {
+    std::vector<float> cosLUT;
+    std::vector<float> sinLUT;
+    float zHoppingLUT[2] = {};
+};
+
 /*
     Class representing the entire magnet system. 
     The magnet system consists of three power supplies, one for each axis. 
@@ -165,6 +769,35 @@ public:
     // Controller variables
     DWORD dwResult;
     XINPUT_STATE state;
+    DWORD lastPacketNumber = 0;
+
+    // Polar steering of the xy field with the left stick, instead of scaling x and y independently
+    bool polarJoystick = false;
+    JoystickSteering steering;
+    bool steeringHeld = false; // the last polar set-points were applied in full
+
+    // Read back every uploaded list and compare it with the one sent, see verifyUploads()
+    bool verifyLists = false;
+    double lastVerifyMs = 0; // time the last readback took, which delays the start of the lists
+
+    // Seconds between readbacks of the output currents in run(); 0 disables them
+    double readbackInterval = 0;
+    std::chrono::steady_clock::time_point lastReadback;
+
+    // Held set-points are checked against the coil limits this often, see limitHeldSetpoints()
+    std::chrono::steady_clock::time_point lastLimiterTick;
+
+    // Seconds between dumps of the I/O statistics of the power supplies to the log; 0 disables them
+    double statsInterval = 0;
+    std::chrono::steady_clock::time_point lastStatsDump;
+
+    // State of the control loop for the metrics server, published by publishMetrics()
+    SnapshotCell<ControlSample> controlSample;
+    uint64_t loopIterations = 0;
+    uint64_t publishedIterations = 0;
+    float readbacks[3] = { NAN, NAN, NAN };
+    std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point lastPublish;
 
     // Max voltage
     float voltageLimit;
@@ -176,9 +809,22 @@ public:
     // Frequency of hopping motion
     float freq;
 
-    // Lookup tables for x and y currents
-    float cosLUT[NUM_STEPS];
-    float sinLUT[NUM_STEPS];
+    // Lookup tables for x and y currents, with `steps` samples per turn
+    int steps = NUM_STEPS;
+    std::vector<float> cosLUT;
+    std::vector<float> sinLUT;
+    Arena waveformArena; // scratch of fillTrigLUTs()
+
+    // Delay of the X and Z starts behind Y in ms, see startSupplies()
+    double skewMs = 57;
+
+    // Settings the system was configured with, and where to reload them from while running (if not NULL)
+    Config config;
+    ConfigLoader* configLoader = NULL;
+    std::chrono::steady_clock::time_point lastConfigCheck;
+    // Settings reloaded while hopping, applied once it stops
+    Config deferredConfig;
+    bool configDeferred = false;
 
     // Lookup table for z current, only 2 elements [zCurrent, -zCurrent]
     float zHoppingLUT[2];
@@ -187,32 +833,516 @@ public:
     int lastKeyPressed = 0;
 
     // Is the system running?
-    bool active = true;
+    std::atomic<bool> active{ true };
+
+    // Copies of the waveform settings and tables for the I/O threads, see publishWaveforms().
+    // The threads read these instead of the members above, which only the control loop uses.
+    SeqLock<WaveformParameters> parameters;
+    SnapshotCell<WaveformTables> tables;
+
+    // Slots holding the pre-staged waveforms in the first bank, counted from firstSlot; the second bank
+    // holds the same waveforms SLOTS_PER_BANK slots higher. Hopping slots are indexed by direction
+    // (right, up, left, down); the z list is the same for every direction.
+    const int HOPPING_SLOTS[4] = { 1, 2, 3, 4 };
+    const int ROTATION_SLOT = 5;
+    const int Z_HOPPING_SLOT = 1;
+    const int SLOTS_PER_BANK = 5;
+    // Waveforms of a bank: the four hopping directions, then the rotation
+    const int BANK_WAVEFORMS = 5;
+
+    // Are the waveforms stored in the active bank of the list memory of all three power supplies?
+    // They are only stored if the list-slots setting gives the saved setups they may replace, from firstSlot.
+    bool useListSlots = false;
+    int firstSlot = 0;
+
+    // Double buffering of the list memory: starts recall the active bank while changed waveforms are
+    // stored in the other one, one waveform at a time (see stageNextSlot()). stageNext is the next
+    // waveform to store, or -1 if the inactive bank is not being staged.
+    int activeBank = 0;
+    int stageNext = -1;
+
+    // Phase of the hopping waveform being played. The lists started at sample hopOffset of the waveform
+    // in direction hopStart at hopStartTime, and advance one sample every 1 / freq / steps seconds.
+    bool hopping = false;
+    int hopStart = 0;
+    int hopOffset = 0;
+    std::chrono::steady_clock::time_point hopStartTime;
+
+    // Replay of recorded controller inputs instead of the controller, see startReplay(), and of the
+    // reloads of the settings, see checkConfig().
+    // timeScale is the speed of the replay; the simulated links and the 57 ms skew are scaled by it.
+    std::vector<ReplayInput> replay;
+    size_t replayNext = 0;
+    std::vector<ReplaySettings> replaySettings;
+    size_t replaySettingsNext = 0;
+    std::chrono::steady_clock::time_point replayStartTime;
+    double timeScale = 1;
+
+    // Lookup tables of the sweep in progress by steps and xy current, see sweepTables(). Filled by
+    // whichever thread encodes a point, so they are only used under sweepTablesLock.
+    std::map<std::pair<int, float>, std::shared_ptr<const WaveformTables> > sweepTableCache;
+    std::mutex sweepTablesLock;
 
     // Constructor for the MagnetSystem class.
-    MagnetSystem(const char* descriptorX, const char* descriptorY, const char* descriptorZ,
-        float zCurrent, float xyCurrent, float freq, float voltageLimit) {
-        PSX = PowerSupply(descriptorX);
-        PSY = PowerSupply(descriptorY);
-        PSZ = PowerSupply(descriptorZ);
-        PSX.reset();
-        PSY.reset();
-        PSZ.reset();
-        this->zCurrent = zCurrent;
-        this->xyCurrent = xyCurrent;
-        this->voltageLimit = voltageLimit;
-        this->freq = freq;
+    // The power supplies are opened on the given descriptors; everything else comes from `config`.
+    MagnetSystem(const char* descriptorX, const char* descriptorY, const char* descriptorZ, const Config& config) {
+        // Open and reset the power supplies concurrently
+        std::thread t1(&MagnetSystem::connect, this, &PSX, descriptorX, 'X', config.coilLimits, config.dacBits[0]);
+        std::thread t2(&MagnetSystem::connect, this, &PSY, descriptorY, 'Y', config.coilLimits, config.dacBits[1]);
+        std::thread t3(&MagnetSystem::connect, this, &PSZ, descriptorZ, 'Z', config.coilLimits, config.dacBits[2]);
+        t1.join();
+        t2.join();
+        t3.join();
+        // Fail once, from this thread, now that no other thread uses the VISA sessions
+        if (PSX.noResourceManager || PSY.noResourceManager || PSZ.noResourceManager) {
+            printf("Could not open a session to the VISA Resource Manager!\n\n");
+            exit(EXIT_FAILURE);
+        }
+        const char* descriptors[3] = { descriptorX, descriptorY, descriptorZ };
+        const PowerSupply* supplies[3] = { &PSX, &PSY, &PSZ };
+        bool connected = true;
+        for (int i = 0; i < 3; i++) {
+            if (!supplies[i]->connected) {
+                printf("Cannot open a session to %s (status %ld)!\n\n", descriptors[i], (long)supplies[i]->status);
+                connected = false;
+            }
+        }
+        if (!connected) {
+            exit(EXIT_FAILURE);
+        }
+        this->config = config;
+        firstSlot = config.listSlots[0];
+        applyWaveforms(config);
+        recordSessionSettings(config);
+        stageListSlots();
+    }
+
+    // Take the waveform and timing settings of `config`.
+    void applyWaveforms(const Config& config) {
+        zCurrent = config.zCurrent;
+        xyCurrent = config.xyCurrent;
+        voltageLimit = config.voltageLimit;
+        freq = config.freq;
+        steps = config.steps;
+        skewMs = config.skewMs;
+        readbackInterval = config.readbackInterval;
+        statsInterval = config.statsInterval;
+        verifyLists = config.verifyLists;
+        PSX.verifyTolerance = PSY.verifyTolerance = PSZ.verifyTolerance = config.verifyTolerance;
+        polarJoystick = config.polarJoystick;
+        steering.rate = config.joystickRate;
         fillTrigLUTs(xyCurrent);
         zHoppingLUT[0] = zCurrent;
         zHoppingLUT[1] = -zCurrent;
+        publishWaveforms(true);
+    }
+
+    // Reload the settings if their file changed, or a replay reached a reload of the recording, at most
+    // every half second of session time.
+    void checkConfig() {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        if (std::chrono::duration<double>(now - lastConfigCheck).count() * timeScale < 0.5) {
+            return;
+        }
+        lastConfigCheck = now;
+        if (configDeferred && !hopping) {
+            configDeferred = false;
+            applyReloaded(deferredConfig);
+        }
+        if (replaySettingsNext < replaySettings.size() && replaySettings[replaySettingsNext].timeNs <= replayElapsedNs()) {
+            reloadConfig(replaySettings[replaySettingsNext++].config);
+            return;
+        }
+        Config reloaded;
+        if (configLoader == NULL || !configLoader->changed() || !configLoader->load(&reloaded, true)) {
+            return;
+        }
+        reloadConfig(reloaded);
+    }
+
+    // Take reloaded settings and record them.
+    // The power supplies stay connected and keep their output; new waveforms are used from the next start,
+    // and are staged in the inactive bank of the list memory if it was in use. Changed ports need a restart.
+    // While hopping, new waveforms are only taken once it stopped.
+    void reloadConfig(const Config& reloaded) {
+        recordSessionSettings(reloaded);
+        // The phase of the hopping is tracked against the lists playing, see currentHoppingSample(), so
+        // new waveforms wait until it stops; the coil limits apply at once
+        if (hopping && !reloaded.sameWaveforms(config)) {
+            PSX.limiter.limits = reloaded.coilLimits;
+            PSY.limiter.limits = reloaded.coilLimits;
+            PSZ.limiter.limits = reloaded.coilLimits;
+            deferredConfig = reloaded;
+            configDeferred = true;
+            LOG_INFO("Reloaded %s, waveforms take effect once the hopping stops", configSource());
+            return;
+        }
+        configDeferred = false;
+        applyReloaded(reloaded);
     }
 
-    // Fill the cosine and sine lookup tables with values.
+    // Where reloaded settings come from: the settings file, or the recording being replayed.
+    const char* configSource() const {
+        return configLoader != NULL ? configLoader->path.c_str() : "the recording";
+    }
+
+    // Take the reloaded settings, see reloadConfig().
+    void applyReloaded(const Config& reloaded) {
+        if (!reloaded.samePorts(config)) {
+            LOG_WARNING("Port, list slot and DAC settings in %s take effect after a restart", configSource());
+        }
+        PSX.limiter.limits = reloaded.coilLimits;
+        PSY.limiter.limits = reloaded.coilLimits;
+        PSZ.limiter.limits = reloaded.coilLimits;
+        bool restage = !reloaded.sameWaveforms(config) && (useListSlots || stageNext >= 0);
+        applyWaveforms(reloaded);
+        config = reloaded;
+        LOG_INFO("Reloaded %s%s%s", configSource(), configLoader == NULL || configLoader->preset.empty() ? "" : ", preset ",
+            configLoader != NULL ? configLoader->preset.c_str() : "");
+        if (restage) {
+            restageListSlots();
+        }
+    }
+
+    // Publish the waveform settings, and the lookup tables if they changed, to the I/O threads.
+    void publishWaveforms(bool newTables) {
+        WaveformParameters published;
+        published.zCurrent = zCurrent;
+        published.xyCurrent = xyCurrent;
+        published.freq = freq;
+        published.voltageLimit = voltageLimit;
+        published.steps = steps;
+        published.skewMs = skewMs;
+        published.timeScale = timeScale;
+        parameters.store(published);
+        if (newTables) {
+            WaveformTables next;
+            next.cosLUT = cosLUT;
+            next.sinLUT = sinLUT;
+            next.zHoppingLUT[0] = zHoppingLUT[0];
+            next.zHoppingLUT[1] = zHoppingLUT[1];
+            tables.store(next);
+        }
+    }
+
+    // Slot of `base` (one of the slots above) in `bank`.
+    int bankSlot(int base, int bank) const {
+        return firstSlot - 1 + base + bank * SLOTS_PER_BANK;
+    }
+
+    // Store waveform `index` of a bank (see BANK_WAVEFORMS) in `bank` of one power supply.
+    // axis is 0 for x, 1 for y or 2 for z; the z supply only stores its hopping list.
+    // Runs on an I/O thread, so it reads the published settings and tables.
+    void stageSlot(PowerSupply* ps, int axis, int index, int bank) {
+        Platform::instance().enterThread(ThreadRole::Io, axis);
+        WaveformParameters waveform = parameters.load();
+        SnapshotCell<WaveformTables>::Snapshot table = tables.snapshot();
+        if (axis == 2) {
+            if (index == 0) {
+                ps->setCurrentList(table->zHoppingLUT, 2, waveform.voltageLimit, 1 / waveform.freq, 0);
+                storeVerified(ps, bankSlot(Z_HOPPING_SLOT, bank));
+            }
+            return;
+        }
+        const float* LUT = axis == 0 ? table->cosLUT.data() : table->sinLUT.data();
+        float dwell = 1 / waveform.freq / waveform.steps;
+        if (index < 4) {
+            ps->setHoppingCurrentList(LUT, waveform.steps, waveform.voltageLimit, dwell, 0, index * waveform.steps / 4);
+            storeVerified(ps, bankSlot(HOPPING_SLOTS[index], bank));
+        }
+        else {
+            ps->setCurrentList(LUT, waveform.steps, waveform.voltageLimit, dwell, 0);
+            storeVerified(ps, bankSlot(ROTATION_SLOT, bank));
+        }
+    }
+
+    // Store the list just uploaded to `slot`, unless the upload was aborted, or verifyLists is set and it
+    // does not read back correctly. A slot that is not stored is marked empty, so the bank is not used.
+    void storeVerified(PowerSupply* ps, int slot) {
+        if (!ps->pendingStart || (verifyLists && !ps->verifyList())) {
+            ps->pendingStart = false;
+            ps->slotLoaded[slot] = false;
+            return;
+        }
+        ps->storeListSlot(slot, 0);
+    }
+
+    // Read back the lists just uploaded to the x and y power supplies, and to the z one if `z` is set,
+    // concurrently. Does nothing unless verifyLists is set; mismatches are logged and the lists still start.
+    void verifyUploads(bool z) {
+        if (!verifyLists) {
+            lastVerifyMs = 0;
+            return;
+        }
+        std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+        std::thread t1(&MagnetSystem::verifyWrapper, this, &PSX);
+        std::thread t2(&MagnetSystem::verifyWrapper, this, &PSY);
+        if (z) {
+            PSZ.verifyList();
+        }
+        t1.join();
+        t2.join();
+        lastVerifyMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+    }
+
+    // Wrapper for reading back lists concurrently
+    void verifyWrapper(PowerSupply* ps) {
+        Platform::instance().enterThread(ThreadRole::Io, ps->axis - 'X');
+        ps->verifyList();
+    }
+
+    // Upload the lists of one power supply to the slots of the active bank.
+    void stageSupplySlots(PowerSupply* ps, int axis) {
+        if (!ps->probeListSlots(bankSlot(HOPPING_SLOTS[0], activeBank))) {
+            return;
+        }
+        for (int index = 0; index < BANK_WAVEFORMS; index++) {
+            stageSlot(ps, axis, index, activeBank);
+        }
+    }
+
+    // Do all three power supplies hold every waveform of `bank`?
+    bool bankLoaded(int bank) const {
+        if (!PSX.slotsSupported || !PSY.slotsSupported || !PSZ.slotsSupported
+            || !PSZ.slotLoaded[bankSlot(Z_HOPPING_SLOT, bank)]) {
+            return false;
+        }
+        for (int index = 0; index < BANK_WAVEFORMS; index++) {
+            int slot = bankSlot(index < 4 ? HOPPING_SLOTS[index] : ROTATION_SLOT, bank);
+            if (!PSX.slotLoaded[slot] || !PSY.slotLoaded[slot]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Pre-stage all four hopping directions and the rotation in the list memory of the power supplies,
+    // so a direction change only has to recall a slot. Falls back to uploading the lists on demand
+    // if no slots are configured or any of the power supplies cannot store lists.
+    void stageListSlots() {
+        if (firstSlot <= 0) {
+            std::cout << "List memory slots off (see list-slots), lists will be uploaded on demand\n\n";
+            return;
+        }
+        printf("Storing the waveforms in slots %d to %d of the power supplies, replacing the setups saved there\n\n",
+            firstSlot, firstSlot + WAVEFORM_SLOTS - 1);
+        std::thread t1(&MagnetSystem::stageSupplySlots, this, &PSX, 0);
+        std::thread t2(&MagnetSystem::stageSupplySlots, this, &PSY, 1);
+        std::thread t3(&MagnetSystem::stageSupplySlots, this, &PSZ, 2);
+        t1.join();
+        t2.join();
+        t3.join();
+        stageNext = -1;
+        useListSlots = bankLoaded(activeBank);
+        if (useListSlots) {
+            std::cout << "Waveforms stored in list memory\n\n";
+        }
+        else {
+            std::cout << "List memory slots not available, lists will be uploaded on demand\n\n";
+        }
+    }
+
+    // The waveforms changed: upload lists on demand until the inactive bank holds the new ones.
+    void restageListSlots() {
+        useListSlots = false;
+        stageNext = PSX.slotsSupported && PSY.slotsSupported && PSZ.slotsSupported ? 0 : -1;
+    }
+
+    // Store the next waveform of the inactive bank on all three power supplies, unless one of them plays
+    // a list: the list memory an upload goes through is the one being played. After the last waveform the
+    // banks swap, so the next start recalls the new waveforms on every axis at once.
+    void stageNextSlot() {
+        if (stageNext < 0 || PSX.shadow.listMode || PSY.shadow.listMode || PSZ.shadow.listMode) {
+            return;
+        }
+        int bank = 1 - activeBank;
+        std::thread t1(&MagnetSystem::stageSlot, this, &PSX, 0, stageNext, bank);
+        std::thread t2(&MagnetSystem::stageSlot, this, &PSY, 1, stageNext, bank);
+        std::thread t3(&MagnetSystem::stageSlot, this, &PSZ, 2, stageNext, bank);
+        t1.join();
+        t2.join();
+        t3.join();
+        if (++stageNext < BANK_WAVEFORMS) {
+            return;
+        }
+        stageNext = -1;
+        if (bankLoaded(bank)) {
+            activeBank = bank;
+            useListSlots = true;
+            LOG_INFO("Waveforms staged, list memory bank %d active", bank + 1);
+        }
+        else {
+            LOG_WARNING("Staging list memory bank %d failed, lists will be uploaded on demand", bank + 1);
+        }
+    }
+
+    // Connect a power supply, reset it and choose its list encoding.
+    // A power supply that cannot be opened is left to the constructor to report, without sending anything:
+    // every command to it would only spend the retries and reconnects of recover().
+    void connect(PowerSupply* ps, const char* descriptor, char axis, CoilLimits coilLimits, int dacBits) {
+        Platform::instance().enterThread(ThreadRole::Io, axis - 'X');
+        *ps = PowerSupply(descriptor);
+        ps->axis = axis;
+        ps->limiter.limits = coilLimits;
+        ps->dacBits = dacBits;
+        if (!ps->connected) {
+            return;
+        }
+        ps->reset();
+        ps->probeListEncoding();
+        ps->probeDwellList();
+    }
+
+    // Fill the cosine and sine lookup tables with one turn of `curr` amps, see Waveform.h.
     void fillTrigLUTs(float curr) {
-        for (int i = 0; i < NUM_STEPS; i++) {
-            this->cosLUT[i] = cos((i * 2 * M_PI) / NUM_STEPS) * curr;
-            this->sinLUT[i] = sin((i * 2 * M_PI) / NUM_STEPS) * curr;
+        waveformArena.reset();
+        WaveformSamples turn = rotationWaveform(steps, curr, &waveformArena);
+        cosLUT.assign(turn.axes[0], turn.axes[0] + steps);
+        sinLUT.assign(turn.axes[1], turn.axes[1] + steps);
+    }
+
+    // Play back `inputs` in place of the controller, and the reloads of `settings` after the first, which the
+    // system was built with, `speed` times faster than they were recorded.
+    // The simulated power supplies, the coil limiters and the readbacks are sped up by the same factor.
+    void startReplay(const std::vector<ReplayInput>& inputs, const std::vector<ReplaySettings>& settings, double speed) {
+        replay = inputs;
+        replayNext = 0;
+        replaySettings = settings;
+        replaySettingsNext = 1;
+        timeScale = speed;
+        publishWaveforms(false);
+        PSX.simulation.timeScale = speed;
+        PSY.simulation.timeScale = speed;
+        PSZ.simulation.timeScale = speed;
+        PSX.limiter.timeScale = speed;
+        PSY.limiter.timeScale = speed;
+        PSZ.limiter.timeScale = speed;
+        ZeroMemory(&state, sizeof(XINPUT_STATE));
+        replayStartTime = std::chrono::steady_clock::now();
+    }
+
+    // Next state of a replay. Every input is delivered by its own poll, once it is due, so the control loop
+    // sees the same sequence of states however fast it runs. After the last input the buttons are released
+    // and the system stops.
+    DWORD replayState() {
+        double elapsedNs = replayElapsedNs();
+        if (replayNext < replay.size() && replay[replayNext].timeNs <= elapsedNs) {
+            const InputRecord& input = replay[replayNext].input;
+            state.Gamepad.wButtons = input.buttons;
+            state.Gamepad.sThumbLX = input.thumbLX;
+            state.Gamepad.sThumbLY = input.thumbLY;
+            state.Gamepad.sThumbRX = input.thumbRX;
+            state.Gamepad.sThumbRY = input.thumbRY;
+            state.Gamepad.bLeftTrigger = input.leftTrigger;
+            state.Gamepad.bRightTrigger = input.rightTrigger;
+            state.dwPacketNumber++;
+            replayNext++;
+        }
+        else if (replayNext == replay.size() && state.Gamepad.wButtons != 0) {
+            state.Gamepad.wButtons = 0;
+            state.dwPacketNumber++;
+        }
+        else if (replayNext == replay.size()) {
+            active = false;
+        }
+        return ERROR_SUCCESS;
+    }
+
+    // Recorded time the replay has reached, in ns since the first input.
+    double replayElapsedNs() const {
+        return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - replayStartTime).count() * timeScale;
+    }
+
+    // Read the state of the controller, or of the replay, and record it when it changed.
+    void pollController() {
+        Platform::instance().idle();
+        loopIterations++;
+        dwResult = replay.empty() ? XInputGetState(0, &state) : replayState();
+        if (dwResult == ERROR_SUCCESS && state.dwPacketNumber != lastPacketNumber) {
+            lastPacketNumber = state.dwPacketNumber;
+            InputRecord input;
+            input.buttons = state.Gamepad.wButtons;
+            input.thumbLX = state.Gamepad.sThumbLX;
+            input.thumbLY = state.Gamepad.sThumbLY;
+            input.thumbRX = state.Gamepad.sThumbRX;
+            input.thumbRY = state.Gamepad.sThumbRY;
+            input.leftTrigger = state.Gamepad.bLeftTrigger;
+            input.rightTrigger = state.Gamepad.bRightTrigger;
+            Recorder::instance().recordInput(input);
+        }
+    }
+
+    // Read back the output currents if readbackInterval has passed since the last readback.
+    void sampleReadbacks() {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        if (readbackInterval <= 0 || std::chrono::duration<double>(now - lastReadback).count() * timeScale < readbackInterval) {
+            return;
+        }
+        lastReadback = now;
+        readbacks[0] = PSX.readCurrent();
+        readbacks[1] = PSY.readCurrent();
+        readbacks[2] = PSZ.readCurrent();
+    }
+
+    // Check the held set-points against the coil limits, ten times per second.
+    void limitHeldSetpoints() {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        if (std::chrono::duration<double>(now - lastLimiterTick).count() < 0.1) {
+            return;
+        }
+        lastLimiterTick = now;
+        PSX.limitHeldSetpoint();
+        PSY.limitHeldSetpoint();
+        PSZ.limitHeldSetpoint();
+    }
+
+    // I/O statistics of the power supply of `axis` ('X', 'Y' or 'Z') so far. Safe to call from any thread.
+    PortStats ioStats(char axis) const {
+        const PowerSupply& ps = axis == 'X' ? PSX : (axis == 'Y' ? PSY : PSZ);
+        return ps.io->query();
+    }
+
+    // Log the I/O statistics of the power supplies if statsInterval has passed since the last dump.
+    void dumpStats() {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        if (statsInterval <= 0 || std::chrono::duration<double>(now - lastStatsDump).count() < statsInterval) {
+            return;
+        }
+        lastStatsDump = now;
+        const PowerSupply* supplies[3] = { &PSX, &PSY, &PSZ };
+        for (int i = 0; i < 3; i++) {
+            PortStats stats = supplies[i]->io->query();
+            LOG_INFO("%s: %llu writes, %llu bytes, %llu failed, %llu failed reads, p50 <= %.3f ms, p99 <= %.3f ms, "
+                "max %.3f ms, queue %d, %llu bytes saved", supplies[i]->session.descriptor().c_str(),
+                (unsigned long long)stats.writes, (unsigned long long)stats.bytes, (unsigned long long)stats.failedWrites,
+                (unsigned long long)stats.readErrors, stats.latencyQuantile(0.5) / 1000, stats.latencyQuantile(0.99) / 1000,
+                stats.maxLatencyUs / 1000, stats.maxQueueDepth, (unsigned long long)(stats.savedByEncoding + stats.savedBySlots));
+        }
+    }
+
+    // Publish the state of the control loop for the metrics server, at most four times per second.
+    void publishMetrics() {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        double elapsed = std::chrono::duration<double>(now - lastPublish).count();
+        if (elapsed < 0.25) {
+            return;
+        }
+        ControlSample sample;
+        sample.iterations = loopIterations;
+        sample.loopRate = publishedIterations > 0 ? (loopIterations - publishedIterations) / elapsed : 0;
+        sample.uptime = std::chrono::duration<double>(now - startTime).count();
+        const PowerSupply* supplies[3] = { &PSX, &PSY, &PSZ };
+        for (int i = 0; i < 3; i++) {
+            sample.setpoints[i] = supplies[i]->shadow.current;
+            sample.readbacks[i] = readbacks[i];
+            sample.output[i] = supplies[i]->shadow.output;
+            sample.listMode[i] = supplies[i]->shadow.listMode;
         }
+        sample.hopping = hopping;
+        sample.freq = freq;
+        controlSample.store(sample);
+        lastPublish = now;
+        publishedIterations = loopIterations;
     }
 
     // Initialize the controller.
@@ -227,19 +1357,52 @@ public:
         }
     }
 
-    // Wrapper for multithreaded execution
-    // For some reason, ASRL4::INSTR is slower than the other two by ~57ms
-    // sleep_for is used to correct that
-    void executeCommandWrapper(PowerSupply* ps, bool sleep) {
-        if (sleep) {
-            std::this_thread::sleep_for(std::chrono::milliseconds(57));
-        }
+    // Wrapper for multithreaded execution: write the pending command of `ps` at `deadline`.
+    void executeCommandWrapper(PowerSupply* ps, std::chrono::steady_clock::time_point deadline) {
+        Platform::instance().enterThread(ThreadRole::Io, ps->axis - 'X');
+        ps->startTiming.add(DeadlineTimer::instance().sleepUntil(deadline));
         ps->executeCommand();
     }
 
+    // Execute the pending commands of the x and y power supplies, and of the z one if `z` is set, concurrently.
+    // For some reason, ASRL4::INSTR is slower than the other two by ~57ms (skewMs), so the x and z
+    // commands are scheduled that long after the y one, against the same start time.
+    void startSupplies(bool z) {
+        WaveformParameters waveform = parameters.load();
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        std::chrono::steady_clock::time_point skewed = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double, std::milli>(waveform.skewMs / waveform.timeScale));
+        std::thread t1(&MagnetSystem::executeCommandWrapper, this, &PSX, skewed);
+        std::thread t2(&MagnetSystem::executeCommandWrapper, this, &PSY, start);
+        if (z) {
+            std::thread t3(&MagnetSystem::executeCommandWrapper, this, &PSZ, skewed);
+            t3.join();
+        }
+        t1.join();
+        t2.join();
+    }
+
     // Control the power supplies using the joystick.
     // The position of the joystick determines angle of the particles.
+    // In polar mode only its direction counts, and set-points are sent when it changes. They are sent
+    // again while the x and y power supplies do not hold them: after a reset or a list, or while the
+    // coil limiter slows down the change.
     void joystickControl() {
+        if (polarJoystick) {
+            float x, y;
+            if (!steeringHeld || !PSX.shadow.output || PSX.shadow.listMode || !PSY.shadow.output || PSY.shadow.listMode) {
+                steering.resend();
+            }
+            if (steering.update(state.Gamepad.sThumbLX, state.Gamepad.sThumbLY, xyCurrent, &x, &y)) {
+                std::thread t1(&MagnetSystem::setCurrentWrapper, this, &PSX, x);
+                std::thread t2(&MagnetSystem::setCurrentWrapper, this, &PSY, y);
+                t1.join();
+                t2.join();
+                steeringHeld = PSX.status >= VI_SUCCESS && PSY.status >= VI_SUCCESS && !PSX.limiter.slewing()
+                    && !PSY.limiter.slewing();
+            }
+            return;
+        }
         float LX = state.Gamepad.sThumbLX;
         // std::cout << "Left Joystick X-Value " << LX << "\n";
         PSX.setCurrent((LX / 32768) * xyCurrent, voltageLimit);
@@ -266,22 +1429,11 @@ public:
     void xButtonControl() {
         if (state.Gamepad.wButtons == 16384) {
             lastKeyPressed = state.Gamepad.wButtons;
-
-            // Send all the lists to the power supplies
-            PSX.setCurrentList(cosLUT, NUM_STEPS, voltageLimit, 1 / freq / NUM_STEPS, 0);
-            PSY.setCurrentList(sinLUT, NUM_STEPS, voltageLimit, 1 / freq / NUM_STEPS, 0);
-
-            // Execute the commands concurrently
-            std::thread t1(&MagnetSystem::executeCommandWrapper, this, &PSX, true);
-            std::thread t2(&MagnetSystem::executeCommandWrapper, this, &PSY, false);
-
-            // Remove threads after finishing
-            t1.join();
-            t2.join();
+            startRotation();
         }
         // Keep it running when the button is pressed
         while (state.Gamepad.wButtons == lastKeyPressed && state.Gamepad.wButtons != 0) {
-            dwResult = XInputGetState(0, &state);
+            pollController();
         }
         // Reset the power supplies when the button is released
         if (state.Gamepad.wButtons == 0 && lastKeyPressed == 16384) {
@@ -295,9 +1447,7 @@ public:
     // Stop all commands and reset the power supplies.
     void startButtonControl() {
         if (state.Gamepad.wButtons == 16) {
-            PSX.reset();
-            PSY.reset();
-            PSZ.reset();
+            stop();
             active = false;
         }
     }
@@ -305,69 +1455,494 @@ public:
     // Control the power supplies using the direction pad.
     // Move the particles in the direction of the pressed button.
     void dirPadControl() {
-        if (state.Gamepad.wButtons > 0 && state.Gamepad.wButtons < 9) {
-            lastKeyPressed = state.Gamepad.wButtons;
-            int start = 0;
-            switch (lastKeyPressed) {
-            case 8: // right
-                start = 0;
+        int direction;
+        if (!padDirection(state.Gamepad.wButtons, &direction)) {
+            return;
+        }
+        lastKeyPressed = state.Gamepad.wButtons;
+        startHopping(direction);
+        // Keep it running while the pad is pressed, without going back to the other controls, which would
+        // reset the power supplies. Pressing another direction without releasing switches directions
+        // without a reset; rolling over a diagonal keeps the direction until a single one is pressed.
+        while ((state.Gamepad.wButtons & 15) != 0) {
+            pollController();
+            if (state.Gamepad.wButtons != lastKeyPressed && padDirection(state.Gamepad.wButtons, &direction)) {
+                lastKeyPressed = state.Gamepad.wButtons;
+                startHopping(direction);
+            }
+        }
+        // Reset the power supplies when the pad is released
+        stop();
+        lastKeyPressed = 0;
+    }
+
+    // Hopping direction of a single pressed direction of the pad: 0 right, 1 up, 2 left, 3 down.
+    // Returns false for anything else, like diagonals.
+    static bool padDirection(WORD buttons, int* direction) {
+        switch (buttons) {
+        case 8: // right
+            *direction = 0;
+            return true;
+        case 1: // up
+            *direction = 1;
+            return true;
+        case 4: // left
+            *direction = 2;
+            return true;
+        case 2: // down
+            *direction = 3;
+            return true;
+        }
+        return false;
+    }
+
+    // Start the rotation on the x and y power supplies.
+    void startRotation() {
+        hopping = false;
+
+        // Select the stored rotation, or send all the lists to the power supplies
+        if (useListSlots) {
+            PSX.selectListSlot(bankSlot(ROTATION_SLOT, activeBank));
+            PSY.selectListSlot(bankSlot(ROTATION_SLOT, activeBank));
+        }
+        else {
+            PSX.setCurrentList(cosLUT.data(), steps, voltageLimit, 1 / freq / steps, 0);
+            PSY.setCurrentList(sinLUT.data(), steps, voltageLimit, 1 / freq / steps, 0);
+            verifyUploads(false);
+        }
+
+        // Execute the commands concurrently
+        startSupplies(false);
+    }
+
+    // Start hopping in `direction`: 0 right, 1 up, 2 left, 3 down.
+    // If the system is already hopping in another direction, the new waveform continues its phase.
+    void startHopping(int direction) {
+        int start = direction * steps / 4;
+        int offset = 0;
+        if (hopping && start != hopStart) {
+            // Switching directions while hopping: continue from the angle the field will have when
+            // the new lists start, estimated from the previous upload times and the skew.
+            double ahead = (PSX.lastUpload.ms + PSY.lastUpload.ms + PSZ.lastUpload.ms + lastVerifyMs + skewMs) / 1000;
+            offset = continuingSample(start, hoppingIndex(hopStart, currentHoppingSample(ahead), steps));
+            setHoppingLists(start, offset);
+            verifyUploads(true);
+        }
+        // Select the stored lists, or send all the lists to the power supplies
+        else if (useListSlots) {
+            PSX.selectListSlot(bankSlot(HOPPING_SLOTS[direction], activeBank));
+            PSY.selectListSlot(bankSlot(HOPPING_SLOTS[direction], activeBank));
+            PSZ.selectListSlot(bankSlot(Z_HOPPING_SLOT, activeBank));
+        }
+        else {
+            setHoppingLists(start, 0);
+            verifyUploads(true);
+        }
+
+        // Execute the commands concurrently. The phase is only tracked from lists that are playing on all
+        // three power supplies; after an aborted upload the next direction starts over.
+        startSupplies(true);
+        hopping = PSX.status >= VI_SUCCESS && PSY.status >= VI_SUCCESS && PSZ.status >= VI_SUCCESS;
+        if (!hopping) {
+            LOG_WARNING("Hopping did not start on every power supply");
+            return;
+        }
+        hopStart = start;
+        hopOffset = offset;
+        hopStartTime = std::chrono::steady_clock::now();
+    }
+
+    // Reset all power supplies.
+    void stop() {
+        PSX.reset();
+        PSY.reset();
+        PSZ.reset();
+        hopping = false;
+    }
+
+    // Wrapper for setting the currents concurrently
+    void setCurrentWrapper(PowerSupply* ps, float current) {
+        Platform::instance().enterThread(ThreadRole::Io, ps->axis - 'X');
+        ps->setCurrent(current, parameters.load().voltageLimit);
+    }
+
+    // Set the currents of all three power supplies at once.
+    void setField(float x, float y, float z) {
+        hopping = false;
+        std::thread t1(&MagnetSystem::setCurrentWrapper, this, &PSX, x);
+        std::thread t2(&MagnetSystem::setCurrentWrapper, this, &PSY, y);
+        std::thread t3(&MagnetSystem::setCurrentWrapper, this, &PSZ, z);
+        t1.join();
+        t2.join();
+        t3.join();
+    }
+
+    // Change the frequency of the rotation and hopping for the next start.
+    // The waveforms in the list memory no longer match, so lists are uploaded on demand until the new
+    // ones are staged in the inactive bank.
+    void setFrequency(float freq) {
+        this->freq = freq;
+        publishWaveforms(false);
+        restageListSlots();
+    }
+
+    // Change the z and xy currents of the rotation and hopping for the next start, like setFrequency().
+    void setAmplitude(float zCurrent, float xyCurrent) {
+        this->zCurrent = zCurrent;
+        this->xyCurrent = xyCurrent;
+        fillTrigLUTs(xyCurrent);
+        zHoppingLUT[0] = zCurrent;
+        zHoppingLUT[1] = -zCurrent;
+        publishWaveforms(true);
+        restageListSlots();
+    }
+
+    // Execute a batch of operations received by the control server.
+    // A SetField followed by another SetField in the same batch is skipped, since it would be replaced at once.
+    void handleControl(const std::vector<ControlOperation>& operations, std::vector<ControlStatus>* statuses) {
+        for (size_t i = 0; i < operations.size(); i++) {
+            const ControlOperation& op = operations[i];
+            ControlStatus& result = (*statuses)[i];
+            PSX.status = PSY.status = PSZ.status = VI_SUCCESS;
+            switch (op.code) {
+            case ControlCode::SetField:
+                if (!std::isfinite(op.args[0]) || !std::isfinite(op.args[1]) || !std::isfinite(op.args[2])) {
+                    result = ControlStatus::InvalidArgument;
+                }
+                else if (i + 1 < operations.size() && operations[i + 1].code == ControlCode::SetField) {
+                    result = ControlStatus::Skipped;
+                }
+                else {
+                    setField(op.args[0], op.args[1], op.args[2]);
+                }
+                break;
+            case ControlCode::StartRotation:
+                startRotation();
+                break;
+            case ControlCode::StartHopping:
+                if (op.args[0] < 0 || op.args[0] > 3) {
+                    result = ControlStatus::InvalidArgument;
+                }
+                else {
+                    startHopping((int)op.args[0]);
+                }
+                break;
+            case ControlCode::Stop:
+                stop();
                 break;
-            case 1: // up
-                start = NUM_STEPS / 4;
+            case ControlCode::SetFrequency:
+                if (!(op.args[0] > 0) || !std::isfinite(op.args[0])) {
+                    result = ControlStatus::InvalidArgument;
+                }
+                else {
+                    setFrequency(op.args[0]);
+                }
                 break;
-            case 4: // left
-                start = NUM_STEPS / 2;
+            case ControlCode::SetAmplitude:
+                if (!std::isfinite(op.args[0]) || !std::isfinite(op.args[1])) {
+                    result = ControlStatus::InvalidArgument;
+                }
+                else {
+                    setAmplitude(op.args[0], op.args[1]);
+                }
                 break;
-            case 2: // down
-                start = NUM_STEPS * 3 / 4;
+            case ControlCode::Ping:
+                break;
+            default:
+                result = ControlStatus::UnknownOperation;
                 break;
             }
-            // Send all the lists to the power supplies
-            PSX.setHoppingCurrentList(cosLUT, voltageLimit, 1 / freq / NUM_STEPS, 0, 0);
-            PSY.setHoppingCurrentList(sinLUT, voltageLimit, 1 / freq / NUM_STEPS, 0, 0);
-            PSZ.setCurrentList(zHoppingLUT, 2, voltageLimit, 1 / freq, 0);
-
-            // Execute the commands concurrently
-            std::thread t1(&MagnetSystem::executeCommandWrapper, this, &PSX, true);
-            std::thread t2(&MagnetSystem::executeCommandWrapper, this, &PSY, false);
-            std::thread t3(&MagnetSystem::executeCommandWrapper, this, &PSZ, true);
-
-            // Remove threads after finishing
-            t1.join();
-            t2.join();
-            t3.join();
+            if (result == ControlStatus::Ok && (PSX.status < VI_SUCCESS || PSY.status < VI_SUCCESS || PSZ.status < VI_SUCCESS)) {
+                result = ControlStatus::IOError;
+            }
         }
-        // Keep it running when the button is pressed
-        while (state.Gamepad.wButtons == lastKeyPressed && state.Gamepad.wButtons != 0) {
-            dwResult = XInputGetState(0, &state);
+    }
+
+    // Hold the particles at the target of `controller`, which runs on its own thread.
+    // Its latest set-point is sent whenever the previous one has been written, until the start button is pressed.
+    void track(PositionController* controller) {
+        controller->pid[0].limit = xyCurrent;
+        controller->pid[1].limit = xyCurrent;
+        controller->pid[2].limit = zCurrent;
+        controller->start();
+        uint64_t sequence = 0;
+        float currents[3];
+        while (active) {
+            if (controller->setpoint(currents, &sequence)) {
+                setField(currents[0], currents[1], currents[2]);
+            }
+            else {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            pollController();
+            sampleReadbacks();
+            limitHeldSetpoints();
+            dumpStats();
+            publishMetrics();
+            checkConfig();
+            stageNextSlot();
+            startButtonControl();
         }
-        // Reset the power supplies when the button is released
-        if (state.Gamepad.wButtons == 0 && lastKeyPressed > 0 && lastKeyPressed < 9) {
-            PSX.reset();
-            PSY.reset();
-            PSZ.reset();
-            lastKeyPressed = 0;
+        controller->stop();
+        controller->stats.report("Position control loop", controller->targetPeriod());
+        std::cout << "\n";
+    }
+
+    // Serve control connections on 127.0.0.1:port until the start button of the controller is pressed.
+    void serve(int port) {
+        ControlServer server;
+        if (!server.listen(port)) {
+            std::cout << "Cannot listen on port " << port << "\n\n";
+            return;
+        }
+        while (active) {
+            server.poll(50, [this](const std::vector<ControlOperation>& operations, std::vector<ControlStatus>* statuses) {
+                handleControl(operations, statuses);
+            });
+            pollController();
+            sampleReadbacks();
+            limitHeldSetpoints();
+            dumpStats();
+            publishMetrics();
+            checkConfig();
+            stageNextSlot();
+            startButtonControl();
+        }
+        std::cout << "Control server: " << server.requests << " requests, " << server.operations << " operations, "
+            << server.dropped << " clients closed for unread responses\n\n";
+    }
+
+    // Sample of the hopping waveform that will be played `ahead` seconds from now.
+    int currentHoppingSample(double ahead) {
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - hopStartTime).count() + ahead;
+        long long samples = (long long)(elapsed * freq * steps);
+        return (int)((hopOffset + samples) % (steps * 2));
+    }
+
+    // Sample of the hopping waveform in direction `start` that continues from LUT index `angle`.
+    // Angles on the holds start the hold; all other angles are passed once by one of the half turns.
+    int continuingSample(int start, int angle) {
+        int difference = (angle - start + steps) % steps;
+        if (difference == 0) {
+            return 0;
+        }
+        if (difference == steps / 2) {
+            return steps;
+        }
+        return difference < steps / 2 ? steps / 2 + difference : steps + difference;
+    }
+
+    // Upload the hopping lists in direction `start`, rotated to begin at sample `offset` of the waveform.
+    // The z list is sent at the sample resolution when it does not start at one of its two halves.
+    void setHoppingLists(int start, int offset) {
+        PSX.setHoppingCurrentList(cosLUT.data(), steps, voltageLimit, 1 / freq / steps, 0, start, offset);
+        PSY.setHoppingCurrentList(sinLUT.data(), steps, voltageLimit, 1 / freq / steps, 0, start, offset);
+        if (offset % steps == 0) {
+            float zList[2] = { zHoppingLUT[offset / steps], zHoppingLUT[1 - offset / steps] };
+            PSZ.setCurrentList(zList, 2, voltageLimit, 1 / freq, 0);
+            return;
+        }
+        std::vector<float> zList(steps * 2);
+        for (int i = 0; i < steps * 2; i++) {
+            zList[i] = zHoppingLUT[(i + offset) % (steps * 2) < steps ? 0 : 1];
         }
+        PSZ.setCurrentList(zList.data(), steps * 2, voltageLimit, 1 / freq / steps, 0);
+    }
+
+    // Lookup tables of one turn of `xyCurrent` amps in `steps` samples for a sweep. Computed once per
+    // sweep and shared by every point with the same amplitude, whatever its frequency, z current or shape.
+    std::shared_ptr<const WaveformTables> sweepTables(int steps, float xyCurrent) {
+        std::lock_guard<std::mutex> guard(sweepTablesLock);
+        std::shared_ptr<const WaveformTables>& cached = sweepTableCache[std::make_pair(steps, xyCurrent)];
+        if (!cached) {
+            Arena arena;
+            WaveformSamples turn = rotationWaveform(steps, xyCurrent, &arena);
+            std::shared_ptr<WaveformTables> computed = std::make_shared<WaveformTables>();
+            computed->cosLUT.assign(turn.axes[0], turn.axes[0] + steps);
+            computed->sinLUT.assign(turn.axes[1], turn.axes[1] + steps);
+            cached = computed;
+        }
+        return cached;
+    }
+
+    // Encode the lists of one point of a sweep for the three power supplies.
+    // Uses the lookup tables of the sweep and the published settings, so it can run on another thread
+    // while the previous point plays.
+    PreparedPoint preparePoint(const SweepPoint& point) {
+        std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+        WaveformParameters waveform = parameters.load();
+        PreparedPoint prepared;
+        std::shared_ptr<const WaveformTables> table = sweepTables(waveform.steps, point.xyCurrent);
+        const float* cosTable = table->cosLUT.data();
+        const float* sinTable = table->sinLUT.data();
+        float dwell = 1 / point.freq / waveform.steps;
+        if (point.shape == SWEEP_ROTATION) {
+            // The z field stays constant during the rotation
+            prepared.lists[0] = PSX.prepareList(cosTable, waveform.steps, waveform.voltageLimit, dwell, 0);
+            prepared.lists[1] = PSY.prepareList(sinTable, waveform.steps, waveform.voltageLimit, dwell, 0);
+            prepared.lists[2] = PSZ.prepareList(&point.zCurrent, 1, waveform.voltageLimit, 1 / point.freq, 0);
+        }
+        else {
+            int start = point.shape * waveform.steps / 4;
+            std::vector<float> xList(waveform.steps * 2);
+            std::vector<float> yList(waveform.steps * 2);
+            for (int i = 0; i < waveform.steps * 2; i++) {
+                xList[i] = cosTable[hoppingIndex(start, i, waveform.steps)];
+                yList[i] = sinTable[hoppingIndex(start, i, waveform.steps)];
+            }
+            float zList[2] = { point.zCurrent, -point.zCurrent };
+            prepared.lists[0] = PSX.prepareList(xList.data(), waveform.steps * 2, waveform.voltageLimit, dwell, 0);
+            prepared.lists[1] = PSY.prepareList(yList.data(), waveform.steps * 2, waveform.voltageLimit, dwell, 0);
+            prepared.lists[2] = PSZ.prepareList(zList, 2, waveform.voltageLimit, 1 / point.freq, 0);
+        }
+        prepared.prepareMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+        return prepared;
+    }
+
+    // Wrapper for uploading prepared lists concurrently
+    void uploadPreparedWrapper(PowerSupply* ps, const PreparedList* list) {
+        Platform::instance().enterThread(ThreadRole::Io, ps->axis - 'X');
+        ps->uploadPreparedList(*list);
+        if (verifyLists) {
+            ps->verifyList();
+        }
+    }
+
+    // Play every point of a sweep for `dwell` seconds, `repeat` times over, and log the timing of each
+    // point to `logPath`. The sweep ends early when the start button is pressed.
+    void runSweep(const std::vector<SweepPoint>& points, double dwell, int repeat, const std::string& logPath) {
+        SweepLog log;
+        log.open(logPath);
+        SweepStats stats;
+        sweepTableCache.clear();
+        std::map<std::string, PreparedPoint> cache;
+        std::future<PreparedPoint> next;
+        size_t total = points.size() * repeat;
+        std::cout << "Sweeping " << points.size() << " points" << (repeat > 1 ? " " + std::to_string(repeat) + " times" : "")
+            << ", " << dwell << " s each\n\n";
+        std::chrono::steady_clock::time_point pointEnd = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < total && active; i++) {
+            const SweepPoint& point = points[i % points.size()];
+            PointTiming timing;
+            std::map<std::string, PreparedPoint>::iterator cached = cache.find(point.name());
+            if (cached != cache.end()) {
+                timing.cached = true;
+            }
+            else {
+                std::chrono::steady_clock::time_point waitBegin = std::chrono::steady_clock::now();
+                timing.ahead = next.valid();
+                PreparedPoint prepared = timing.ahead ? next.get() : preparePoint(point);
+                timing.waitMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - waitBegin).count();
+                timing.prepareMs = prepared.prepareMs;
+                cached = cache.insert(std::make_pair(point.name(), prepared)).first;
+            }
+            const PreparedPoint& prepared = cached->second;
+
+            // Send the lists to the three power supplies at once, then start them like startHopping()
+            std::chrono::steady_clock::time_point uploadBegin = std::chrono::steady_clock::now();
+            std::thread u1(&MagnetSystem::uploadPreparedWrapper, this, &PSX, &prepared.lists[0]);
+            std::thread u2(&MagnetSystem::uploadPreparedWrapper, this, &PSY, &prepared.lists[1]);
+            std::thread u3(&MagnetSystem::uploadPreparedWrapper, this, &PSZ, &prepared.lists[2]);
+            u1.join();
+            u2.join();
+            u3.join();
+            std::chrono::steady_clock::time_point startBegin = std::chrono::steady_clock::now();
+            startSupplies(true);
+            std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+            hopping = false;
+            // An aborted upload leaves nothing to start, see PowerSupply::uploadPreparedList()
+            timing.uploaded = PSX.status >= VI_SUCCESS && PSY.status >= VI_SUCCESS && PSZ.status >= VI_SUCCESS;
+            timing.uploadMs = std::chrono::duration<double, std::milli>(startBegin - uploadBegin).count();
+            timing.startMs = std::chrono::duration<double, std::milli>(started - startBegin).count();
+            timing.deadMs = std::chrono::duration<double, std::milli>(started - pointEnd).count();
+            timing.bytes = PSX.lastUpload.bytesOnWire + PSY.lastUpload.bytesOnWire + PSZ.lastUpload.bytesOnWire;
+
+            // Encode the next point while this one plays
+            if (i + 1 < total && cache.find(points[(i + 1) % points.size()].name()) == cache.end()) {
+                SweepPoint upcoming = points[(i + 1) % points.size()];
+                next = std::async(std::launch::async, [this, upcoming]() {
+                    Platform::instance().enterThread(ThreadRole::Planning);
+                    return preparePoint(upcoming);
+                });
+            }
+
+            pointEnd = started + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(dwell));
+            while (active && std::chrono::steady_clock::now() < pointEnd) {
+                std::chrono::steady_clock::time_point wake = std::chrono::steady_clock::now() + std::chrono::milliseconds(10);
+                DeadlineTimer::instance().sleepUntil(wake < pointEnd ? wake : pointEnd);
+                pollController();
+                sampleReadbacks();
+                limitHeldSetpoints();
+                dumpStats();
+                publishMetrics();
+                startButtonControl();
+            }
+            pointEnd = std::chrono::steady_clock::now();
+            timing.dwellS = std::chrono::duration<double>(pointEnd - started).count();
+            log.write((int)i, point, timing);
+            if (!timing.uploaded) {
+                LOG_ERROR("Sweep point %zu/%zu %s: lists not uploaded, nothing played", i + 1, total, point.name().c_str());
+            }
+            else {
+                LOG_INFO("Sweep point %zu/%zu %s: upload %.1f ms, start %.1f ms, dead time %.1f ms%s", i + 1, total,
+                    point.name().c_str(), timing.uploadMs, timing.startMs, timing.deadMs, timing.cached ? ", cached" : "");
+            }
+            stats.add(timing);
+        }
+        if (next.valid()) {
+            next.wait();
+        }
+        stop();
+        stats.report();
     }
 
     // Test the hopping function
     void testHopping() {
-        PSX.setHoppingCurrentList(cosLUT, voltageLimit, 1 / freq / NUM_STEPS, 0, 0);
-        PSY.setHoppingCurrentList(sinLUT, voltageLimit, 1 / freq / NUM_STEPS, 0, 0);
+        PSX.setHoppingCurrentList(cosLUT.data(), steps, voltageLimit, 1 / freq / steps, 0, 0);
+        PSY.setHoppingCurrentList(sinLUT.data(), steps, voltageLimit, 1 / freq / steps, 0, 0);
         PSZ.setCurrentList(zHoppingLUT, 2, voltageLimit, 1 / freq, 0);
-        std::thread t1(&MagnetSystem::executeCommandWrapper, this, &PSX, true);
-        std::thread t2(&MagnetSystem::executeCommandWrapper, this, &PSY, false);
-        std::thread t3(&MagnetSystem::executeCommandWrapper, this, &PSZ, true);
-        t1.join();
-        t2.join();
-        t3.join();
+        verifyUploads(true);
+        startSupplies(true);
+    }
+
+    // Print how the errors on the serial links were handled and the size of the list uploads.
+    void reportConnections() {
+        Logger::instance().flush();
+        PSX.recovery.report(PSX.session.descriptor());
+        PSY.recovery.report(PSY.session.descriptor());
+        PSZ.recovery.report(PSZ.session.descriptor());
+        std::cout << "\nList uploads:\n";
+        PSX.uploadTotals.report(PSX.session.descriptor(), PSX.encoding);
+        PSY.uploadTotals.report(PSY.session.descriptor(), PSY.encoding);
+        PSZ.uploadTotals.report(PSZ.session.descriptor(), PSZ.encoding);
+        std::cout << "\n";
+        PSX.limiter.report(PSX.session.descriptor());
+        PSY.limiter.report(PSY.session.descriptor());
+        PSZ.limiter.report(PSZ.session.descriptor());
+        PSX.verifyStats.report(PSX.session.descriptor());
+        PSY.verifyStats.report(PSY.session.descriptor());
+        PSZ.verifyStats.report(PSZ.session.descriptor());
+        std::cout << "\nI/O statistics:\n";
+        PSX.io->query().report(PSX.session.descriptor());
+        PSY.io->query().report(PSY.session.descriptor());
+        PSZ.io->query().report(PSZ.session.descriptor());
+        PSX.startTiming.report(PSX.session.descriptor() + " start");
+        PSY.startTiming.report(PSY.session.descriptor() + " start");
+        PSZ.startTiming.report(PSZ.session.descriptor() + " start");
+        printf("Command buffers: %zu allocated\n", CommandPool::instance().blocks());
     }
 
     // Run the controller.
     void run() {
         while (active) {
-            dwResult = XInputGetState(0, &state);
+            pollController();
             //std::cout << state.Gamepad.wButtons << "\n";
+            sampleReadbacks();
+            limitHeldSetpoints();
+            dumpStats();
+            publishMetrics();
+            checkConfig();
+            stageNextSlot();
             joystickControl();
             triggerControl();
             xButtonControl();
@@ -388,30 +1963,175 @@ public:
 * help is located in your NI-VISA directory or folder.
 */
 
-int main(void) {
-    float voltageLimit = 20;
-    float freq;
+// Run the magnet system on simulated power supplies with the inputs and parameters of a recording.
+// The replay is recorded to replay-<time>.rec, to be compared with compareRecordings().
+int replayRecording(const char* path, double speed) {
+    std::vector<Record> records;
+    if (!readRecording(path, &records)) {
+        return EXIT_FAILURE;
+    }
+    std::vector<ReplaySettings> settings = replaySettings(records);
+    if (settings.empty()) {
+        std::cout << path << " has no session parameters\n";
+        return EXIT_FAILURE;
+    }
+    Config config = settings[0].config;
+    std::vector<ReplayInput> inputs = replayInputs(records);
+    if (inputs.empty()) {
+        std::cout << path << " has no controller inputs\n";
+        return EXIT_FAILURE;
+    }
+    if (speed <= 0) {
+        speed = 1;
+    }
 
-    /*Initializing the device to zero */
-    std::cout << "freq: ";
-    std::cin >> freq;
-    std::cout << "\n";
+    char recordingName[64];
+    time_t now = time(NULL);
+    strftime(recordingName, sizeof(recordingName), "replay-%Y%m%d-%H%M%S.rec", localtime(&now));
+    if (!Recorder::instance().open(recordingName, 1 << 18)) {
+        std::cout << "Cannot record the replay to " << recordingName << "\n";
+        return EXIT_FAILURE;
+    }
+    std::cout << "Replaying " << inputs.size() << " inputs of " << path << " at " << speed << "x\n\n";
 
-    // Z-FIELD 
-    float zCurrent;
-    std::cout << "z-field current: ";
-    std::cin >> zCurrent;
-    std::cout << "\n";
+    MagnetSystem magnets(SIMULATED_DESCRIPTOR "X", SIMULATED_DESCRIPTOR "Y", SIMULATED_DESCRIPTOR "Z", config);
+    magnets.startReplay(inputs, settings, speed);
+    magnets.run();
+    magnets.reportConnections();
+    Logger::instance().report();
+    Recorder::instance().close();
+    return EXIT_SUCCESS;
+}
 
-    // XY-FIELD 
-    float xyCurrent;
-    std::cout << "xy-field current: ";
-    std::cin >> xyCurrent;
-    std::cout << "\n";
+int main(int argc, char* argv[]) {
+    // Export a recording instead of running: --export-recording <recording> <output prefix>
+    if (argc == 4 && strcmp(argv[1], "--export-recording") == 0) {
+        return exportRecording(argv[2], argv[3]) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+    // Compare the replays of two builds: --compare-recordings <base recording> <new recording>
+    if (argc == 4 && strcmp(argv[1], "--compare-recordings") == 0) {
+        return compareRecordings(argv[2], argv[3]);
+    }
+    // Replay the controller inputs of a recording against simulated power supplies:
+    // --replay <recording> [speed]
+    if ((argc == 3 || argc == 4) && strcmp(argv[1], "--replay") == 0) {
+        return replayRecording(argv[2], argc == 4 ? atof(argv[3]) : 1);
+    }
+    // Check the snapshots shared with the I/O threads for torn reads: --stress-snapshots [seconds] [threads]
+    if (argc >= 2 && argc <= 4 && strcmp(argv[1], "--stress-snapshots") == 0) {
+        double seconds = argc >= 3 ? atof(argv[2]) : 5;
+        int threads = argc == 4 ? atoi(argv[3]) : 4;
+        return stressSnapshots(seconds, threads > 0 ? threads : 1) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    // Compare the waveform generator with the scalar loops: --waveform-benchmark [samples] [repeats]
+    if (argc >= 2 && argc <= 4 && strcmp(argv[1], "--waveform-benchmark") == 0) {
+        benchmarkWaveforms(argc >= 3 ? atoi(argv[2]) : 4096, argc == 4 ? atoi(argv[3]) : 1000);
+        return EXIT_SUCCESS;
+    }
+    // Compare sleeping with sleeping and spinning to deadlines: --timing-benchmark [period ms] [deadlines]
+    if (argc >= 2 && argc <= 4 && strcmp(argv[1], "--timing-benchmark") == 0) {
+        DeadlineTimer::instance().calibrate(200);
+        benchmarkDeadlines(argc >= 3 ? atof(argv[2]) : 1, argc == 4 ? atoi(argv[3]) : 1000);
+        return EXIT_SUCCESS;
+    }
+    // Measure the round trip to a running control server: --control-ping <port> <requests>
+    if (argc == 4 && strcmp(argv[1], "--control-ping") == 0) {
+        return pingControlServer(atoi(argv[2]), atoi(argv[3])) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    // Send SetField, StartRotation, StartHopping and Stop to a running control server: --control-check <port>
+    if (argc == 3 && strcmp(argv[1], "--control-check") == 0) {
+        return checkControlServer(atoi(argv[2])) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    // Settings come from magnets.cfg (or --config <path>), its preset, and "--<key> <value>" overrides,
+    // see Config.h. E.g. --freq 2 --z-current 1 --xy-current 2, --simulate, --serve <port>,
+    // --track <feed> with --target <x,y,z> --gains <kp,ki,kd>, --coil-limits <rated,peak,tau,slew>,
+    // --sweep with --sweep-freq 0.5:2:0.5 --sweep-shape hop-right,rotation --sweep-dwell <seconds>,
+    // --list-slots 1,10 to store the waveforms in saved setups 1 to 10 of the power supplies.
+    ConfigLoader configLoader;
+    configLoader.parseArguments(argc, argv);
+    Config config;
+    if (!configLoader.load(&config)) {
+        return EXIT_FAILURE;
+    }
+    // The waveform modes play the configured currents; without any, they would play lists of zeros
+    if (config.serve <= 0 && config.track.empty() && !config.currentsSet) {
+        std::cout << "No currents set: give z-current and xy-current in " << configLoader.path
+            << " or on the command line\n\n";
+        return EXIT_FAILURE;
+    }
+
+    // Scheduling, cores and memory locking of the threads (see Platform.h), and the wake-up
+    // jitter they give, before any power supply is opened
+    Platform::instance().configure(config.platform);
+    Platform::instance().measureWakeJitter(1, 200).report(1);
+    if (config.spinMarginUs < 0) {
+        printf("Spinning %.1f us before deadlines\n\n", DeadlineTimer::instance().calibrate(200));
+    }
+    else {
+        DeadlineTimer::instance().setSpinMargin(config.spinMarginUs);
+    }
 
-    MagnetSystem magnets = MagnetSystem("ASRL3::INSTR", "ASRL4::INSTR", "ASRL5::INSTR",
-        zCurrent, xyCurrent, freq, voltageLimit);
+    // Record the session to a file named after the start time
+    char recordingName[64];
+    time_t now = time(NULL);
+    strftime(recordingName, sizeof(recordingName), "session-%Y%m%d-%H%M%S.rec", localtime(&now));
+    if (!Recorder::instance().open(recordingName, 1 << 18)) {
+        std::cout << "Cannot record to " << recordingName << ", running without a recording\n\n";
+    }
+
+    // Find the power supplies and map them to the axes by serial number (see axes.cfg).
+    // Axes missing from the map keep the configured ports.
+    std::string descriptors[3] = { config.ports[0], config.ports[1], config.ports[2] };
+    SessionManager& sessions = SessionManager::instance();
+    if (config.simulate) {
+        descriptors[0] = SIMULATED_DESCRIPTOR "X";
+        descriptors[1] = SIMULATED_DESCRIPTOR "Y";
+        descriptors[2] = SIMULATED_DESCRIPTOR "Z";
+    }
+    else if (config.discover && sessions.open() >= VI_SUCCESS) {
+        std::vector<DiscoveredDevice> devices = discoverDevices(&sessions, 500);
+        assignAxes(devices, loadAxisMap(config.axisMap.c_str()), descriptors);
+    }
+
+    MagnetSystem magnets(descriptors[0].c_str(), descriptors[1].c_str(), descriptors[2].c_str(), config);
+    magnets.configLoader = &configLoader;
+    // Declared after the magnet system, so it stops before the state it reads is gone
+    MetricsServer metrics;
+    if (config.metricsPort > 0) {
+        std::shared_ptr<PortCounters> ports[3] = { magnets.PSX.io, magnets.PSY.io, magnets.PSZ.io };
+        std::string names[3] = { "X", "Y", "Z" };
+        if (!metrics.start(config.metricsPort, &magnets.controlSample, ports, names)) {
+            std::cout << "Cannot serve metrics on port " << config.metricsPort << "\n\n";
+        }
+    }
+    // Release the ports of identified instruments that are not used by the magnet system
+    sessions.closeIdle();
+    sessions.report();
     //magnets.initializeController();
     // magnets.run();
-    magnets.testHopping();
+    if (config.serve > 0) {
+        magnets.serve(config.serve);
+    }
+    else if (config.sweep) {
+        magnets.runSweep(sweepPoints(config), config.sweepDwell, config.sweepRepeat, config.sweepLog);
+    }
+    else if (!config.track.empty()) {
+        PositionFeed feed;
+        if (feed.open(config.track)) {
+            PositionController controller(&feed, config.controlRate);
+            for (int i = 0; i < 3; i++) {
+                controller.target[i] = config.target[i];
+                controller.pid[i].kp = config.gains[0];
+                controller.pid[i].ki = config.gains[1];
+                controller.pid[i].kd = config.gains[2];
+            }
+            magnets.track(&controller);
+        }
+    }
+    else {
+        magnets.testHopping();
+    }
+    magnets.reportConnections();
+    Logger::instance().report();
 }
\ No newline at end of file
@@ -0,0 +1,333 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+/*
+    Recorder of an experiment: every command sent to the power supplies, every set-point,
+    input event and readback sample, with nanosecond timestamps.
+    Records go to a ring of fixed-size slots in a memory-mapped file that is allocated and
+    touched when the recorder is opened. Writing a record claims a slot with one atomic
+    increment and copies into the mapping, so the control thread never waits for a lock
+    or a system call. Writers are counted while they use the mapping, and close() waits
+    for them to leave before it unmaps it. The file is read back with exportRecording().
+*/
+
+enum class RecordType : uint8_t {
+    Command = 1,  // text: bytes written, status: VISA status
+    Setpoint = 2, // value: current in amps
+    Input = 3,    // text: InputRecord
+    Readback = 4, // value: measured current in amps
+    Session = 5   // text: settings of the magnet system as "<key>=<value>" pairs, see recordSessionSettings();
+                  // status: records of the same settings still to come
+};
+
+// One record, 128 bytes.
+struct Record {
+    uint64_t sequence;    // 1-based order of the record; 0 marks an empty slot
+    uint64_t timestampNs; // steady clock, since the recorder was opened
+    uint8_t type;
+    char axis;            // 'X', 'Y', 'Z', or 0 if not tied to a supply
+    uint16_t length;      // bytes of text, which may be truncated to sizeof(text)
+    int32_t status;
+    float value;
+    uint32_t reserved;
+    char text[96];
+};
+
+// Gamepad state stored in the text of an input record.
+struct InputRecord {
+    uint16_t buttons;
+    int16_t thumbLX;
+    int16_t thumbLY;
+    int16_t thumbRX;
+    int16_t thumbRY;
+    uint8_t leftTrigger;
+    uint8_t rightTrigger;
+};
+
+// Start of the file, followed by `capacity` records.
+struct RecorderHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t recordSize;
+    uint64_t capacity;
+    int64_t wallClockStartNs; // system clock when the recorder was opened
+};
+
+#define RECORDER_MAGIC "PSCREC1"
+
+class Recorder {
+public:
+    // The recorder shared by the whole process. Records are dropped until it is opened.
+    static Recorder& instance() {
+        static Recorder recorder;
+        return recorder;
+    }
+
+    ~Recorder() {
+        close();
+    }
+
+    // Create `path` with room for `capacity` records and map it.
+    bool open(const char* path, uint64_t capacity) {
+        close();
+        size = sizeof(RecorderHeader) + capacity * sizeof(Record);
+#ifdef _WIN32
+        file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+        mapping = CreateFileMappingA(file, NULL, PAGE_READWRITE, (DWORD)(size >> 32), (DWORD)size, NULL);
+        if (mapping == NULL) {
+            close();
+            return false;
+        }
+        memory = (char*)MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, (SIZE_T)size);
+#else
+        file = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (file < 0 || ftruncate(file, (off_t)size) != 0) {
+            close();
+            return false;
+        }
+        memory = (char*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+        if (memory == MAP_FAILED) {
+            memory = NULL;
+        }
+#endif
+        if (memory == NULL) {
+            close();
+            return false;
+        }
+        // Touch every page now, so no page fault happens while recording
+        memset(memory, 0, size);
+        RecorderHeader* header = (RecorderHeader*)memory;
+        strcpy(header->magic, RECORDER_MAGIC);
+        header->version = 1;
+        header->recordSize = sizeof(Record);
+        header->capacity = capacity;
+        header->wallClockStartNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        this->capacity = capacity;
+        start = std::chrono::steady_clock::now();
+        next.store(0);
+        records.store((Record*)(memory + sizeof(RecorderHeader)));
+        std::cout << "Recording to " << path << "\n\n";
+        return true;
+    }
+
+    // Stop recording and close the file. Records written from then on are dropped; the mapping is only
+    // released once every writer that still had it has left record().
+    void close() {
+        records.store(NULL);
+        while (writers.load() > 0) {
+            std::this_thread::yield();
+        }
+#ifdef _WIN32
+        if (memory != NULL) {
+            FlushViewOfFile(memory, 0);
+            UnmapViewOfFile(memory);
+        }
+        if (mapping != NULL) {
+            CloseHandle(mapping);
+        }
+        if (file != INVALID_HANDLE_VALUE) {
+            CloseHandle(file);
+        }
+        mapping = NULL;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (memory != NULL) {
+            munmap(memory, size);
+        }
+        if (file >= 0) {
+            ::close(file);
+        }
+        file = -1;
+#endif
+        memory = NULL;
+    }
+
+    bool isOpen() const {
+        return records.load() != NULL;
+    }
+
+    // Append a record. Wait-free: safe to call from any thread, never blocks.
+    void record(RecordType type, char axis, const char* text, size_t length, int32_t status, float value) {
+        writers.fetch_add(1);
+        Record* entries = records.load();
+        if (entries == NULL) {
+            writers.fetch_sub(1);
+            return;
+        }
+        uint64_t sequence = next.fetch_add(1, std::memory_order_relaxed) + 1;
+        Record* entry = &entries[(sequence - 1) % capacity];
+        entry->sequence = 0;
+        std::atomic_thread_fence(std::memory_order_release);
+        entry->timestampNs = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        entry->type = (uint8_t)type;
+        entry->axis = axis;
+        entry->length = (uint16_t)(length > 0xFFFF ? 0xFFFF : length);
+        entry->status = status;
+        entry->value = value;
+        if (length > 0) {
+            memcpy(entry->text, text, length < sizeof(entry->text) ? length : sizeof(entry->text));
+        }
+        std::atomic_thread_fence(std::memory_order_release);
+        entry->sequence = sequence;
+        writers.fetch_sub(1);
+    }
+
+    void recordCommand(char axis, const char* data, size_t length, int32_t status) {
+        record(RecordType::Command, axis, data, length, status, 0);
+    }
+
+    void recordSetpoint(char axis, float current) {
+        record(RecordType::Setpoint, axis, NULL, 0, 0, current);
+    }
+
+    void recordReadback(char axis, float current) {
+        record(RecordType::Readback, axis, NULL, 0, 0, current);
+    }
+
+    void recordInput(const InputRecord& input) {
+        record(RecordType::Input, 0, (const char*)&input, sizeof(input), 0, 0);
+    }
+
+    void recordSession(const char* settings, int32_t following = 0) {
+        record(RecordType::Session, 0, settings, strlen(settings), following, 0);
+    }
+
+private:
+    Recorder() : records(NULL), capacity(0), memory(NULL), size(0), next(0), writers(0) {
+#ifdef _WIN32
+        file = INVALID_HANDLE_VALUE;
+        mapping = NULL;
+#else
+        file = -1;
+#endif
+    }
+
+    std::atomic<Record*> records;
+    uint64_t capacity;
+    char* memory;
+    uint64_t size;
+    std::atomic<uint64_t> next;
+    std::atomic<int> writers; // threads inside record()
+    std::chrono::steady_clock::time_point start;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#else
+    int file;
+#endif
+};
+
+// Text of a record for export: commands with non-printable bytes escaped, inputs as fields.
+inline std::string recordText(const Record& record) {
+    std::string text;
+    if (record.type == (uint8_t)RecordType::Input) {
+        InputRecord input;
+        memcpy(&input, record.text, sizeof(input));
+        char fields[128];
+        sprintf(fields, "buttons=%u lx=%d ly=%d rx=%d ry=%d lt=%u rt=%u", input.buttons, input.thumbLX, input.thumbLY,
+            input.thumbRX, input.thumbRY, input.leftTrigger, input.rightTrigger);
+        return fields;
+    }
+    size_t length = record.length < sizeof(record.text) ? record.length : sizeof(record.text);
+    for (size_t i = 0; i < length; i++) {
+        unsigned char c = (unsigned char)record.text[i];
+        if (c >= 32 && c < 127 && c != '"' && c != '\\') {
+            text += (char)c;
+        }
+        else {
+            char escaped[8];
+            sprintf(escaped, "\\x%02x", c);
+            text += escaped;
+        }
+    }
+    if (record.length > sizeof(record.text)) {
+        text += "...";
+    }
+    return text;
+}
+
+// Read the records of a recording, oldest first. Returns false if `path` is not a recording.
+inline bool readRecording(const char* path, std::vector<Record>* records) {
+    std::ifstream file(path, std::ios::binary);
+    RecorderHeader header;
+    if (!file.read((char*)&header, sizeof(header)) || strcmp(header.magic, RECORDER_MAGIC) != 0
+        || header.recordSize != sizeof(Record)) {
+        std::cout << path << " is not a recording\n";
+        return false;
+    }
+    records->clear();
+    Record record;
+    for (uint64_t i = 0; i < header.capacity && file.read((char*)&record, sizeof(record)); i++) {
+        if (record.sequence != 0) {
+            records->push_back(record);
+        }
+    }
+    std::sort(records->begin(), records->end(), [](const Record& a, const Record& b) { return a.sequence < b.sequence; });
+    return true;
+}
+
+// Write the records of a recording, oldest first, to `prefix`.csv and to one binary file per column:
+// `prefix`.sequence (u64), .timestamp_ns (u64), .type (u8), .axis (u8), .status (i32), .value (f32),
+// and the text as .text bytes with .text_offsets (u64, one more than the number of records).
+// Returns the number of records written, or -1 if the recording cannot be read.
+inline long long exportRecording(const char* path, const char* prefix) {
+    std::vector<Record> records;
+    if (!readRecording(path, &records)) {
+        return -1;
+    }
+
+    std::string base(prefix);
+    std::ofstream csv(base + ".csv");
+    std::ofstream sequence(base + ".sequence", std::ios::binary);
+    std::ofstream timestamp(base + ".timestamp_ns", std::ios::binary);
+    std::ofstream type(base + ".type", std::ios::binary);
+    std::ofstream axis(base + ".axis", std::ios::binary);
+    std::ofstream status(base + ".status", std::ios::binary);
+    std::ofstream value(base + ".value", std::ios::binary);
+    std::ofstream text(base + ".text", std::ios::binary);
+    std::ofstream offsets(base + ".text_offsets", std::ios::binary);
+    const char* typeNames[6] = { "", "command", "setpoint", "input", "readback", "session" };
+    csv << "sequence,timestamp_ns,type,axis,status,value,text\n";
+    uint64_t offset = 0;
+    offsets.write((char*)&offset, sizeof(offset));
+    for (size_t i = 0; i < records.size(); i++) {
+        const Record& r = records[i];
+        std::string recordString = recordText(r);
+        csv << r.sequence << "," << r.timestampNs << "," << (r.type <= 5 ? typeNames[r.type] : "unknown") << ","
+            << (r.axis != 0 ? std::string(1, r.axis) : "") << "," << r.status << "," << r.value
+            << ",\"" << recordString << "\"\n";
+        sequence.write((char*)&r.sequence, sizeof(r.sequence));
+        timestamp.write((char*)&r.timestampNs, sizeof(r.timestampNs));
+        type.write((char*)&r.type, sizeof(r.type));
+        axis.write(&r.axis, sizeof(r.axis));
+        status.write((char*)&r.status, sizeof(r.status));
+        value.write((char*)&r.value, sizeof(r.value));
+        text.write(recordString.data(), recordString.size());
+        offset += recordString.size();
+        offsets.write((char*)&offset, sizeof(offset));
+    }
+    std::cout << "Exported " << records.size() << " records to " << base << ".csv and column files\n";
+    return (long long)records.size();
+}
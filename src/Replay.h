@@ -0,0 +1,247 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <iostream>
+#include "visa.h"
+#include "Recorder.h"
+#include "Config.h"
+
+/*
+    Deterministic replay of a recorded session, to compare the behavior of two builds.
+    The controller inputs of a recording are fed back to the magnet system at their recorded
+    times, or faster, with the settings the session started with and every reload of them at its
+    recorded time, while the power supplies are simulated: writes take as long as they would
+    on the serial link and nothing is sent to an instrument. The replay is itself recorded,
+    so the command streams and response times of two replays can be compared with compareRecordings().
+*/
+
+// Descriptor prefix of simulated power supplies, e.g. "SIM::X".
+#define SIMULATED_DESCRIPTOR "SIM::"
+
+inline bool isSimulatedDescriptor(const char* descriptor) {
+    return strncmp(descriptor, SIMULATED_DESCRIPTOR, strlen(SIMULATED_DESCRIPTOR)) == 0;
+}
+
+// Serial link of a simulated power supply. Writes succeed after the transfer time of the bytes
+// at `baud` (8N1, so 10 bits per byte), divided by timeScale. Reads time out, so every probe of the
+// power supply fails the same way and the replay always takes the same code paths.
+struct SimulatedLink {
+    int baud = 9600;
+    double timeScale = 1;
+
+    ViStatus write(size_t length, ViUInt32* writeCount) {
+        if (baud > 0) {
+            double seconds = length * 10.0 / baud / timeScale;
+            std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+        }
+        *writeCount = (ViUInt32)length;
+        return VI_SUCCESS;
+    }
+
+    ViStatus read(ViUInt32* retCount) {
+        *retCount = 0;
+        return VI_ERROR_TMO;
+    }
+};
+
+// A controller input of a recording, at its time since the first input.
+struct ReplayInput {
+    uint64_t timeNs;
+    InputRecord input;
+};
+
+// Controller inputs of a recording, oldest first.
+inline std::vector<ReplayInput> replayInputs(const std::vector<Record>& records) {
+    std::vector<ReplayInput> inputs;
+    uint64_t firstNs = 0;
+    for (size_t i = 0; i < records.size(); i++) {
+        if (records[i].type != (uint8_t)RecordType::Input) {
+            continue;
+        }
+        if (inputs.empty()) {
+            firstNs = records[i].timestampNs;
+        }
+        ReplayInput input;
+        input.timeNs = records[i].timestampNs - firstNs;
+        memcpy(&input.input, records[i].text, sizeof(input.input));
+        inputs.push_back(input);
+    }
+    return inputs;
+}
+
+// Record the control settings of `config` (see Config::controlSettings()), at the start of a session and
+// whenever they are reloaded. They take as many session records as needed; each record holds whole
+// "<key>=<value>" pairs and counts the records still to come in its status.
+inline void recordSessionSettings(const Config& config) {
+    Settings settings = config.controlSettings();
+    std::vector<std::string> texts(1);
+    for (size_t i = 0; i < settings.size(); i++) {
+        std::string pair = settings[i].first + "=" + settings[i].second;
+        if (!texts.back().empty() && texts.back().size() + 1 + pair.size() > sizeof(Record::text)) {
+            texts.push_back(std::string());
+        }
+        texts.back() += (texts.back().empty() ? "" : " ") + pair;
+    }
+    for (size_t i = 0; i < texts.size(); i++) {
+        Recorder::instance().recordSession(texts[i].c_str(), (int32_t)(texts.size() - 1 - i));
+    }
+}
+
+// Settings of a recorded session from the time they were recorded, since the first controller input.
+struct ReplaySettings {
+    uint64_t timeNs;
+    Config config;
+};
+
+// Settings of a recording in the order they were recorded: the ones the session started with, then
+// every reload, each applied over the ones before. Earlier recordings only have the waveforms, with
+// shorter keys, and keep the defaults for everything else.
+inline std::vector<ReplaySettings> replaySettings(const std::vector<Record>& records) {
+    const char* legacyKeys[4][2] = { { "z", "z-current" }, { "xy", "xy-current" }, { "volt", "voltage-limit" },
+        { "skew", "skew-ms" } };
+    uint64_t firstNs = 0;
+    for (size_t i = 0; i < records.size(); i++) {
+        if (records[i].type == (uint8_t)RecordType::Input) {
+            firstNs = records[i].timestampNs;
+            break;
+        }
+    }
+    std::vector<ReplaySettings> settings;
+    Config config;
+    for (size_t i = 0; i < records.size(); i++) {
+        if (records[i].type != (uint8_t)RecordType::Session) {
+            continue;
+        }
+        char text[sizeof(records[i].text) + 1] = {};
+        memcpy(text, records[i].text, records[i].length < sizeof(records[i].text) ? records[i].length : sizeof(records[i].text));
+        std::stringstream pairs(text);
+        std::string pair;
+        while (pairs >> pair) {
+            size_t equals = pair.find('=');
+            if (equals == std::string::npos) {
+                continue;
+            }
+            std::string key = pair.substr(0, equals);
+            for (int k = 0; k < 4; k++) {
+                key = key == legacyKeys[k][0] ? legacyKeys[k][1] : key;
+            }
+            std::string error;
+            if (!config.set(key, pair.substr(equals + 1), &error)) {
+                std::cout << "Recorded setting ignored: " << error << "\n";
+            }
+        }
+        if (records[i].status == 0) {
+            ReplaySettings entry;
+            entry.timeNs = records[i].timestampNs > firstNs ? records[i].timestampNs - firstNs : 0;
+            entry.config = config;
+            settings.push_back(entry);
+        }
+    }
+    return settings;
+}
+
+// Commands sent to each axis, with consecutive repeats removed: the joystick sends its set-points
+// in every loop, so the number of repeats depends on the speed of the loop and not on the build.
+inline std::map<char, std::vector<std::string> > commandStreams(const std::vector<Record>& records) {
+    std::map<char, std::vector<std::string> > streams;
+    for (size_t i = 0; i < records.size(); i++) {
+        if (records[i].type != (uint8_t)RecordType::Command) {
+            continue;
+        }
+        std::vector<std::string>& stream = streams[records[i].axis];
+        std::string text = recordText(records[i]);
+        if (stream.empty() || stream.back() != text) {
+            stream.push_back(text);
+        }
+    }
+    return streams;
+}
+
+// Milliseconds from each change of the buttons to the next command sent to a power supply.
+inline std::vector<double> responseTimes(const std::vector<Record>& records) {
+    std::vector<double> times;
+    bool waiting = false;
+    uint64_t inputNs = 0;
+    uint16_t buttons = 0;
+    for (size_t i = 0; i < records.size(); i++) {
+        if (records[i].type == (uint8_t)RecordType::Input) {
+            InputRecord input;
+            memcpy(&input, records[i].text, sizeof(input));
+            if (input.buttons != buttons && !waiting) {
+                waiting = true;
+                inputNs = records[i].timestampNs;
+            }
+            buttons = input.buttons;
+        }
+        else if (records[i].type == (uint8_t)RecordType::Command && waiting) {
+            times.push_back((records[i].timestampNs - inputNs) / 1e6);
+            waiting = false;
+        }
+    }
+    std::sort(times.begin(), times.end());
+    return times;
+}
+
+inline double percentile(const std::vector<double>& sorted, double fraction) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t index = (size_t)(fraction * (sorted.size() - 1) + 0.5);
+    return sorted[index];
+}
+
+// Compare the replays of two builds: the command stream of every axis, and the response times to
+// the buttons. Returns 0 if the commands match and the response times did not regress, 1 otherwise.
+// A regression is a 95th percentile more than 20 % + 1 ms above the one of `basePath`.
+inline int compareRecordings(const char* basePath, const char* newPath) {
+    std::vector<Record> baseRecords;
+    std::vector<Record> newRecords;
+    if (!readRecording(basePath, &baseRecords) || !readRecording(newPath, &newRecords)) {
+        return 1;
+    }
+    int result = 0;
+    std::map<char, std::vector<std::string> > baseStreams = commandStreams(baseRecords);
+    std::map<char, std::vector<std::string> > newStreams = commandStreams(newRecords);
+    const char axes[3] = { 'X', 'Y', 'Z' };
+    for (int a = 0; a < 3; a++) {
+        const std::vector<std::string>& before = baseStreams[axes[a]];
+        const std::vector<std::string>& after = newStreams[axes[a]];
+        size_t common = before.size() < after.size() ? before.size() : after.size();
+        size_t mismatch = 0;
+        while (mismatch < common && before[mismatch] == after[mismatch]) {
+            mismatch++;
+        }
+        std::cout << axes[a] << ": " << before.size() << " / " << after.size() << " distinct commands";
+        if (mismatch == common && before.size() == after.size()) {
+            std::cout << ", identical\n";
+            continue;
+        }
+        result = 1;
+        std::cout << ", first difference at command " << mismatch + 1 << "\n"
+            << "  base: " << (mismatch < before.size() ? before[mismatch] : "(end)") << "\n"
+            << "  new:  " << (mismatch < after.size() ? after[mismatch] : "(end)") << "\n";
+    }
+
+    std::vector<double> baseTimes = responseTimes(baseRecords);
+    std::vector<double> newTimes = responseTimes(newRecords);
+    printf("Response time to buttons in ms (%zu / %zu presses):\n", baseTimes.size(), newTimes.size());
+    printf("  base: median %.2f, p95 %.2f, max %.2f\n", percentile(baseTimes, 0.5), percentile(baseTimes, 0.95),
+        baseTimes.empty() ? 0.0 : baseTimes.back());
+    printf("  new:  median %.2f, p95 %.2f, max %.2f\n", percentile(newTimes, 0.5), percentile(newTimes, 0.95),
+        newTimes.empty() ? 0.0 : newTimes.back());
+    if (percentile(newTimes, 0.95) > percentile(baseTimes, 0.95) * 1.2 + 1) {
+        std::cout << "Response time regressed\n";
+        result = 1;
+    }
+    std::cout << (result == 0 ? "Replays match\n" : "Replays differ\n");
+    return result;
+}
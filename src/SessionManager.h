@@ -0,0 +1,242 @@
+#pragma once
+
+#include <string>
+#include <map>
+#include <mutex>
+#include <iostream>
+#include "visa.h"
+
+/*
+    Owner of the VISA resource manager and of all instrument sessions.
+    Sessions are handed out as move-only SessionHandles. When a handle is destroyed its session
+    goes back to an idle pool instead of being closed, so the next acquire of the same resource
+    (e.g. the supply identified during discovery) reuses it without opening the port again.
+    A broken session can be reopened in place with reconnect() without restarting the process.
+*/
+
+class SessionManager;
+
+// RAII handle to an open instrument session. Returns the session to the pool when destroyed.
+class SessionHandle {
+public:
+    SessionHandle() : manager(NULL), session(VI_NULL) {
+    }
+
+    SessionHandle(SessionManager* manager, const std::string& descriptor, ViSession session)
+        : manager(manager), rsrc(descriptor), session(session) {
+    }
+
+    SessionHandle(SessionHandle&& other) : manager(other.manager), rsrc(other.rsrc), session(other.session) {
+        other.manager = NULL;
+        other.session = VI_NULL;
+    }
+
+    SessionHandle& operator=(SessionHandle&& other) {
+        if (this != &other) {
+            release();
+            manager = other.manager;
+            rsrc = other.rsrc;
+            session = other.session;
+            other.manager = NULL;
+            other.session = VI_NULL;
+        }
+        return *this;
+    }
+
+    SessionHandle(const SessionHandle&) = delete;
+    SessionHandle& operator=(const SessionHandle&) = delete;
+
+    ~SessionHandle() {
+        release();
+    }
+
+    ViSession get() const {
+        return session;
+    }
+
+    const std::string& descriptor() const {
+        return rsrc;
+    }
+
+    bool valid() const {
+        return manager != NULL && session != VI_NULL;
+    }
+
+    // Give the session back to the idle pool.
+    void release();
+
+    // Close the session instead of pooling it, e.g. when the resource is not a power supply.
+    void discard();
+
+    // Close the session and open the resource again.
+    ViStatus reconnect(int timeoutMs);
+
+private:
+    friend class SessionManager;
+
+    SessionManager* manager;
+    std::string rsrc;
+    ViSession session;
+};
+
+class SessionManager {
+public:
+    // The resource manager shared by the whole process.
+    static SessionManager& instance() {
+        static SessionManager manager;
+        return manager;
+    }
+
+    SessionManager(const SessionManager&) = delete;
+    SessionManager& operator=(const SessionManager&) = delete;
+
+    ~SessionManager() {
+        closeIdle();
+        if (rmOpen) {
+            viClose(defaultRM);
+        }
+    }
+
+    // Open the default resource manager if it is not open yet.
+    ViStatus open() {
+        std::lock_guard<std::mutex> guard(lock);
+        if (rmOpen) {
+            return VI_SUCCESS;
+        }
+        ViStatus status = viOpenDefaultRM(&defaultRM);
+        rmOpen = status >= VI_SUCCESS;
+        return status;
+    }
+
+    ViSession resourceManager() const {
+        return defaultRM;
+    }
+
+    // Hand out a session to `descriptor`, reusing an idle one if possible.
+    // The session timeout is set to timeoutMs either way.
+    ViStatus acquire(const char* descriptor, int timeoutMs, SessionHandle* handle) {
+        ViStatus status = open();
+        if (status < VI_SUCCESS) {
+            return status;
+        }
+        ViSession session = VI_NULL;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            std::multimap<std::string, ViSession>::iterator pooled = idle.find(descriptor);
+            if (pooled != idle.end()) {
+                session = pooled->second;
+                idle.erase(pooled);
+                inUse++;
+                reused++;
+            }
+        }
+        if (session == VI_NULL) {
+            // Opening a serial port is slow, so it happens outside the lock
+            status = viOpen(defaultRM, (ViRsrc)descriptor, VI_NULL, VI_NULL, &session);
+            if (status < VI_SUCCESS) {
+                return status;
+            }
+            std::lock_guard<std::mutex> guard(lock);
+            inUse++;
+            opened++;
+        }
+        *handle = SessionHandle(this, descriptor, session);
+        return viSetAttribute(session, VI_ATTR_TMO_VALUE, timeoutMs);
+    }
+
+    // Close all sessions in the idle pool.
+    void closeIdle() {
+        std::lock_guard<std::mutex> guard(lock);
+        for (std::multimap<std::string, ViSession>::iterator it = idle.begin(); it != idle.end(); ++it) {
+            viClose(it->second);
+        }
+        idle.clear();
+    }
+
+    int openSessionCount() {
+        std::lock_guard<std::mutex> guard(lock);
+        return inUse + (int)idle.size();
+    }
+
+    int inUseSessionCount() {
+        std::lock_guard<std::mutex> guard(lock);
+        return inUse;
+    }
+
+    // Print the number of open sessions and how many were reused or reopened.
+    void report() {
+        std::lock_guard<std::mutex> guard(lock);
+        std::cout << "VISA sessions: " << inUse << " in use, " << idle.size() << " idle, "
+            << opened << " opened, " << reused << " reused, " << reconnected << " reconnected\n\n";
+    }
+
+private:
+    friend class SessionHandle;
+
+    SessionManager() : defaultRM(VI_NULL), rmOpen(false), inUse(0), opened(0), reused(0), reconnected(0) {
+    }
+
+    // A handle whose reconnect failed has no session left, but still counts as in use.
+    void release(SessionHandle* handle) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (handle->session != VI_NULL) {
+            idle.insert(std::make_pair(handle->rsrc, handle->session));
+        }
+        inUse--;
+    }
+
+    void discard(SessionHandle* handle) {
+        if (handle->session != VI_NULL) {
+            viClose(handle->session);
+        }
+        std::lock_guard<std::mutex> guard(lock);
+        inUse--;
+    }
+
+    ViStatus reconnect(SessionHandle* handle, int timeoutMs) {
+        if (handle->session != VI_NULL) {
+            viClose(handle->session);
+        }
+        handle->session = VI_NULL;
+        ViStatus status = viOpen(defaultRM, (ViRsrc)handle->rsrc.c_str(), VI_NULL, VI_NULL, &handle->session);
+        std::lock_guard<std::mutex> guard(lock);
+        reconnected++;
+        if (status < VI_SUCCESS) {
+            handle->session = VI_NULL;
+            return status;
+        }
+        return viSetAttribute(handle->session, VI_ATTR_TMO_VALUE, timeoutMs);
+    }
+
+    std::mutex lock;
+    ViSession defaultRM;
+    bool rmOpen;
+    std::multimap<std::string, ViSession> idle;
+    int inUse;
+    int opened;
+    int reused;
+    int reconnected;
+};
+
+inline void SessionHandle::release() {
+    if (manager != NULL) {
+        manager->release(this);
+    }
+    manager = NULL;
+    session = VI_NULL;
+}
+
+inline void SessionHandle::discard() {
+    if (manager != NULL) {
+        manager->discard(this);
+    }
+    manager = NULL;
+    session = VI_NULL;
+}
+
+inline ViStatus SessionHandle::reconnect(int timeoutMs) {
+    if (manager == NULL) {
+        return VI_ERROR_INV_OBJECT;
+    }
+    return manager->reconnect(this, timeoutMs);
+}
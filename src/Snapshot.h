@@ -0,0 +1,231 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+/*
+    Consistent views of state shared between the control loop and the I/O threads, without locks.
+    A SeqLock holds a small plain struct, like the waveform parameters: the writer bumps a sequence
+    number around its update, and readers copy the struct and retry if the number was odd or changed.
+    A SnapshotCell holds a larger value, like the lookup tables, RCU style: the writer fills a slot no
+    reader holds and then publishes it, and readers pin the published slot while they use it, so they
+    never copy the tables and never see them half written.
+    Both have a single writer, the control loop; any number of threads may read.
+    stressSnapshots() checks both for torn reads under concurrent updates.
+*/
+
+template <typename T>
+class SeqLock {
+    static_assert(std::is_trivially_copyable<T>::value, "SeqLock needs a trivially copyable type");
+
+public:
+    SeqLock() {
+        for (size_t i = 0; i < WORDS; i++) {
+            words[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    // Replace the value. Only one thread may store.
+    void store(const T& value) {
+        uint64_t buffer[WORDS] = {};
+        memcpy(buffer, &value, sizeof(T));
+        uint64_t begin = sequence.load(std::memory_order_relaxed);
+        sequence.store(begin + 1, std::memory_order_relaxed);
+        // A reader that sees any new word also sees the odd sequence number after it
+        for (size_t i = 0; i < WORDS; i++) {
+            words[i].store(buffer[i], std::memory_order_release);
+        }
+        sequence.store(begin + 2, std::memory_order_release);
+    }
+
+    // Copy of the last value stored. retries, if given, is increased by the number of copies
+    // that overlapped a store and had to be repeated.
+    T load(uint64_t* retries = NULL) const {
+        uint64_t buffer[WORDS];
+        uint64_t before;
+        uint64_t after;
+        for (;;) {
+            before = sequence.load(std::memory_order_acquire);
+            for (size_t i = 0; i < WORDS; i++) {
+                buffer[i] = words[i].load(std::memory_order_acquire);
+            }
+            after = sequence.load(std::memory_order_relaxed);
+            if (before == after && (before & 1) == 0) {
+                break;
+            }
+            if (retries != NULL) {
+                (*retries)++;
+            }
+            std::this_thread::yield();
+        }
+        T value;
+        memcpy(&value, buffer, sizeof(T));
+        return value;
+    }
+
+private:
+    static const size_t WORDS = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+    std::atomic<uint64_t> sequence{ 0 };
+    std::atomic<uint64_t> words[WORDS];
+};
+
+template <typename T>
+class SnapshotCell {
+public:
+    // Number of versions kept; a store waits only if readers still hold all the other ones.
+    static const int SLOTS = 4;
+
+    // Pinned published value, released when the snapshot goes out of scope.
+    class Snapshot {
+    public:
+        explicit Snapshot(const SnapshotCell* cell) : cell(cell) {
+            // Pin the published slot, then check it is still the published one: the writer only
+            // reuses slots nobody pins, so once the check passes the slot stays intact.
+            for (;;) {
+                int slot = cell->current.load();
+                cell->readers[slot].fetch_add(1);
+                if (cell->current.load() == slot) {
+                    this->slot = slot;
+                    return;
+                }
+                cell->readers[slot].fetch_sub(1);
+            }
+        }
+
+        Snapshot(Snapshot&& other) : cell(other.cell), slot(other.slot) {
+            other.slot = -1;
+        }
+
+        ~Snapshot() {
+            if (slot >= 0) {
+                cell->readers[slot].fetch_sub(1);
+            }
+        }
+
+        const T& operator*() const {
+            return cell->values[slot];
+        }
+
+        const T* operator->() const {
+            return &cell->values[slot];
+        }
+
+    private:
+        Snapshot(const Snapshot&) = delete;
+        Snapshot& operator=(const Snapshot&) = delete;
+        const SnapshotCell* cell;
+        int slot = -1;
+    };
+
+    SnapshotCell() {
+        for (int i = 0; i < SLOTS; i++) {
+            readers[i].store(0);
+        }
+    }
+
+    // Publish a new value. Only one thread may store.
+    void store(const T& value) {
+        int published = current.load();
+        int slot = (published + 1) % SLOTS;
+        while (slot == published || readers[slot].load() != 0) {
+            slot = (slot + 1) % SLOTS;
+            if (slot == published) {
+                std::this_thread::yield();
+            }
+        }
+        values[slot] = value;
+        current.store(slot);
+    }
+
+    Snapshot snapshot() const {
+        return Snapshot(this);
+    }
+
+private:
+    T values[SLOTS];
+    mutable std::atomic<int> readers[SLOTS];
+    std::atomic<int> current{ 0 };
+};
+
+// Values of a stress test: every field of a version holds its number, so a mix of two versions shows.
+struct StressParameters {
+    uint64_t version;
+    double doubled;
+    float copies[6];
+};
+
+// Update a SeqLock and a SnapshotCell of tables as fast as possible for `seconds` while `readers`
+// threads read them and check every read is one whole version. Returns the number of torn reads.
+inline uint64_t stressSnapshots(double seconds, int readerThreads) {
+    SeqLock<StressParameters> parameters;
+    SnapshotCell<std::vector<float> > tables;
+    const int tableSize = 256;
+    std::vector<float> table(tableSize);
+    for (int i = 0; i < tableSize; i++) {
+        table[i] = (float)i;
+    }
+    parameters.store(StressParameters());
+    tables.store(table);
+
+    std::atomic<bool> running{ true };
+    std::atomic<uint64_t> torn{ 0 };
+    std::atomic<uint64_t> reads{ 0 };
+    std::atomic<uint64_t> retries{ 0 };
+    std::vector<std::thread> readers;
+    for (int r = 0; r < readerThreads; r++) {
+        readers.push_back(std::thread([&]() {
+            uint64_t localReads = 0;
+            uint64_t localRetries = 0;
+            uint64_t localTorn = 0;
+            while (running) {
+                StressParameters value = parameters.load(&localRetries);
+                bool whole = value.doubled == 2.0 * value.version;
+                for (int i = 0; i < 6; i++) {
+                    whole = whole && value.copies[i] == (float)(value.version % 65536);
+                }
+                SnapshotCell<std::vector<float> >::Snapshot table = tables.snapshot();
+                float first = (*table)[0];
+                for (int i = 1; i < tableSize; i++) {
+                    whole = whole && (*table)[i] == first + i;
+                }
+                localTorn += whole ? 0 : 1;
+                localReads++;
+            }
+            reads += localReads;
+            retries += localRetries;
+            torn += localTorn;
+        }));
+    }
+
+    uint64_t version = 0;
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now()
+        + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(seconds));
+    while (std::chrono::steady_clock::now() < end) {
+        version++;
+        StressParameters value;
+        value.version = version;
+        value.doubled = 2.0 * version;
+        for (int i = 0; i < 6; i++) {
+            value.copies[i] = (float)(version % 65536);
+        }
+        parameters.store(value);
+        for (int i = 0; i < tableSize; i++) {
+            table[i] = (float)(version % 1024) + i;
+        }
+        tables.store(table);
+    }
+    running = false;
+    for (size_t r = 0; r < readers.size(); r++) {
+        readers[r].join();
+    }
+    printf("Snapshot stress test: %llu updates, %llu reads by %d threads, %llu retries, %llu torn reads\n",
+        (unsigned long long)version, (unsigned long long)reads.load(), readerThreads,
+        (unsigned long long)retries.load(), (unsigned long long)torn.load());
+    return torn;
+}
@@ -0,0 +1,146 @@
+#pragma once
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <iostream>
+#include "ListEncoding.h"
+#include "Config.h"
+
+/*
+    Unattended sweeps of the waveforms over a grid of frequencies, amplitudes and shapes.
+    Every point of the grid plays for a dwell time, then the next one starts. The power supplies stay
+    connected for the whole sweep. The lists of a point are encoded once and kept, so later passes
+    over the grid only send them; the lists of the next point are encoded on another thread while the
+    current point plays. Sending them has to wait for the end of the point, since the power supplies
+    play from the list memory an upload overwrites. The three power supplies are sent their lists
+    concurrently, and the timing of every point is written to a CSV file.
+*/
+
+struct SweepPoint {
+    int shape = 0; // index into SWEEP_SHAPES
+    float freq = 1;
+    float zCurrent = 0;
+    float xyCurrent = 0;
+
+    // Key of the cached lists of the point.
+    std::string name() const {
+        char text[96];
+        sprintf(text, "%s %g Hz z %g A xy %g A", SWEEP_SHAPES[shape], freq, zCurrent, xyCurrent);
+        return text;
+    }
+};
+
+// Lists of one point for the X, Y and Z power supplies.
+struct PreparedPoint {
+    PreparedList lists[3];
+    double prepareMs = 0;
+};
+
+// Points of the grid of `config`: shapes outermost, then frequencies, z and xy currents.
+inline std::vector<SweepPoint> sweepPoints(const Config& config) {
+    std::vector<int> shapes = config.sweepShapes.empty() ? std::vector<int>(1, 0) : config.sweepShapes;
+    std::vector<float> freqs = config.sweepFreqs.empty() ? std::vector<float>(1, config.freq) : config.sweepFreqs;
+    std::vector<float> zCurrents = config.sweepZCurrents.empty() ? std::vector<float>(1, config.zCurrent) : config.sweepZCurrents;
+    std::vector<float> xyCurrents = config.sweepXyCurrents.empty() ? std::vector<float>(1, config.xyCurrent) : config.sweepXyCurrents;
+    std::vector<SweepPoint> points;
+    for (size_t s = 0; s < shapes.size(); s++) {
+        for (size_t f = 0; f < freqs.size(); f++) {
+            for (size_t z = 0; z < zCurrents.size(); z++) {
+                for (size_t xy = 0; xy < xyCurrents.size(); xy++) {
+                    SweepPoint point;
+                    point.shape = shapes[s];
+                    point.freq = freqs[f];
+                    point.zCurrent = zCurrents[z];
+                    point.xyCurrent = xyCurrents[xy];
+                    points.push_back(point);
+                }
+            }
+        }
+    }
+    return points;
+}
+
+// Timing of one point of a sweep, in ms unless noted.
+// The dead time runs from the end of the previous point to the start of this one.
+struct PointTiming {
+    bool uploaded = false; // every list was uploaded and started
+    bool cached = false;   // lists taken from the cache
+    bool ahead = false;    // lists encoded during the previous point
+    double prepareMs = 0;  // encoding time of the lists, 0 if cached
+    double waitMs = 0;     // time spent waiting for the encoding
+    double uploadMs = 0;
+    double startMs = 0;
+    double deadMs = 0;
+    size_t bytes = 0;      // bytes of the three uploads
+    double dwellS = 0;     // seconds the point played
+};
+
+struct SweepStats {
+    int points = 0;
+    int failed = 0;
+    int cached = 0;
+    int ahead = 0;
+    double deadMs = 0;
+    double maxDeadMs = 0;
+    double prepareMs = 0;
+
+    void add(const PointTiming& timing) {
+        points++;
+        failed += timing.uploaded ? 0 : 1;
+        cached += timing.cached ? 1 : 0;
+        ahead += timing.ahead ? 1 : 0;
+        deadMs += timing.deadMs;
+        maxDeadMs = timing.deadMs > maxDeadMs ? timing.deadMs : maxDeadMs;
+        prepareMs += timing.prepareMs;
+    }
+
+    void report() const {
+        if (points == 0) {
+            std::cout << "Sweep: no points\n\n";
+            return;
+        }
+        printf("Sweep: %d points, %d not uploaded, %d from the cache, %d encoded ahead, %.1f ms encoding, "
+            "dead time %.1f ms mean, %.1f ms max\n\n", points, failed, cached, ahead, prepareMs, deadMs / points, maxDeadMs);
+    }
+};
+
+// CSV file with one line of timing per point.
+class SweepLog {
+public:
+    ~SweepLog() {
+        close();
+    }
+
+    bool open(const std::string& path) {
+        file = fopen(path.c_str(), "w");
+        if (file == NULL) {
+            std::cout << "Cannot write the sweep log " << path << "\n\n";
+            return false;
+        }
+        fprintf(file, "point,shape,freq,z_current,xy_current,uploaded,cached,ahead,prepare_ms,wait_ms,upload_ms,"
+            "start_ms,dead_ms,bytes,dwell_s\n");
+        return true;
+    }
+
+    void write(int index, const SweepPoint& point, const PointTiming& timing) {
+        if (file == NULL) {
+            return;
+        }
+        fprintf(file, "%d,%s,%g,%g,%g,%d,%d,%d,%.3f,%.3f,%.3f,%.3f,%.3f,%zu,%.3f\n", index, SWEEP_SHAPES[point.shape],
+            point.freq, point.zCurrent, point.xyCurrent, timing.uploaded ? 1 : 0, timing.cached ? 1 : 0,
+            timing.ahead ? 1 : 0, timing.prepareMs, timing.waitMs, timing.uploadMs, timing.startMs, timing.deadMs,
+            timing.bytes, timing.dwellS);
+        fflush(file);
+    }
+
+    void close() {
+        if (file != NULL) {
+            fclose(file);
+            file = NULL;
+        }
+    }
+
+private:
+    FILE* file = NULL;
+};
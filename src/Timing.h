@@ -0,0 +1,160 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <iostream>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TIMING_PAUSE() _mm_pause()
+#else
+#define TIMING_PAUSE()
+#endif
+
+/*
+    Waits for absolute deadlines on the steady clock, to a precision the scheduler cannot give.
+    A sleep wakes up late: by up to a timer tick on Windows (1 ms with timeBeginPeriod(1), 15.6 ms
+    without), and by tens of microseconds on Linux. DeadlineTimer sleeps until a margin before the
+    deadline and spins for the rest, so the wait ends within a few microseconds of the deadline.
+    The margin is calibrated at startup from how late sleeps wake up on this machine, so a fine
+    timer means little spinning; a margin of 0 turns spinning off.
+    Deadlines are absolute, so the time taken by the work between two waits does not add up.
+    DeadlineStats collects the errors of the waits, and benchmarkDeadlines() compares plain sleeps
+    with the hybrid wait.
+*/
+
+// Errors of waits for deadlines, in microseconds.
+struct DeadlineStats {
+    // Upper bounds of the buckets of the error histogram; the last bucket holds the rest
+    static const int BUCKETS = 6;
+
+    uint64_t waits = 0;
+    double sumUs = 0;
+    double maxUs = 0;
+    uint64_t buckets[BUCKETS] = {};
+
+    void add(double errorUs) {
+        static const double bounds[BUCKETS - 1] = { 1, 10, 100, 1000, 10000 };
+        int bucket = 0;
+        while (bucket < BUCKETS - 1 && errorUs >= bounds[bucket]) {
+            bucket++;
+        }
+        buckets[bucket]++;
+        waits++;
+        sumUs += errorUs;
+        maxUs = errorUs > maxUs ? errorUs : maxUs;
+    }
+
+    void report(const std::string& name) const {
+        if (waits == 0) {
+            return;
+        }
+        printf("%s: %llu deadlines, %.1f us late on average, %.1f us max; <1 us %llu, <10 us %llu, <100 us %llu, "
+            "<1 ms %llu, <10 ms %llu, more %llu\n", name.c_str(), (unsigned long long)waits, sumUs / waits, maxUs,
+            (unsigned long long)buckets[0], (unsigned long long)buckets[1], (unsigned long long)buckets[2],
+            (unsigned long long)buckets[3], (unsigned long long)buckets[4], (unsigned long long)buckets[5]);
+    }
+};
+
+class DeadlineTimer {
+public:
+    // The timer shared by the whole process.
+    static DeadlineTimer& instance() {
+        static DeadlineTimer timer;
+        return timer;
+    }
+
+    // Sleep until `spinMargin` before `deadline`, then spin until it. Returns how late the wait ended, in us.
+    double sleepUntil(std::chrono::steady_clock::time_point deadline) const {
+        std::chrono::steady_clock::duration margin(spinMarginNs.load(std::memory_order_relaxed));
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        if (deadline - now > margin) {
+            std::this_thread::sleep_until(deadline - margin);
+            now = std::chrono::steady_clock::now();
+        }
+        while (now < deadline) {
+            TIMING_PAUSE();
+            now = std::chrono::steady_clock::now();
+        }
+        return std::chrono::duration<double, std::micro>(now - deadline).count();
+    }
+
+    // Spin for the last `us` microseconds before every deadline; 0 only sleeps.
+    void setSpinMargin(double us) {
+        spinMarginNs = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double, std::micro>(us < 0 ? 0 : us)).count();
+    }
+
+    double spinMargin() const {
+        return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::duration(spinMarginNs.load())).count();
+    }
+
+    // Set the spin margin from `samples` sleeps of 1 ms: the 99th percentile of their lateness plus 20 us,
+    // at most 5 ms, so even a coarse timer does not make every wait a long spin. Returns the margin in us.
+    double calibrate(int samples) {
+        std::vector<double> lateness;
+        std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now();
+        for (int i = 0; i < samples; i++) {
+            deadline += std::chrono::milliseconds(1);
+            std::this_thread::sleep_until(deadline);
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            lateness.push_back(std::chrono::duration<double, std::micro>(now - deadline).count());
+            // Deadlines missed by a whole period are skipped, like a periodic loop would
+            while (deadline < now) {
+                deadline += std::chrono::milliseconds(1);
+            }
+        }
+        if (lateness.empty()) {
+            return spinMargin();
+        }
+        std::sort(lateness.begin(), lateness.end());
+        double margin = lateness[(size_t)(0.99 * (lateness.size() - 1))] + 20;
+        setSpinMargin(margin < 5000 ? margin : 5000);
+        return spinMargin();
+    }
+
+private:
+    DeadlineTimer() {
+    }
+
+    std::atomic<int64_t> spinMarginNs{ 0 };
+};
+
+// Wait for `samples` deadlines `periodMs` apart, first with sleep_until and then with DeadlineTimer,
+// and print the distribution of the errors of both.
+inline void benchmarkDeadlines(double periodMs, int samples) {
+    std::chrono::steady_clock::duration period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::duration<double, std::milli>(periodMs));
+    const char* names[2] = { "sleep_until", "sleep and spin" };
+    printf("Deadlines every %.3f ms, spin margin %.1f us\n", periodMs, DeadlineTimer::instance().spinMargin());
+    for (int method = 0; method < 2; method++) {
+        std::vector<double> errors;
+        std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now();
+        for (int i = 0; i < samples; i++) {
+            deadline += period;
+            if (method == 0) {
+                std::this_thread::sleep_until(deadline);
+                errors.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - deadline).count());
+            }
+            else {
+                errors.push_back(DeadlineTimer::instance().sleepUntil(deadline));
+            }
+        }
+        if (errors.empty()) {
+            return;
+        }
+        std::sort(errors.begin(), errors.end());
+        double mean = 0;
+        for (size_t i = 0; i < errors.size(); i++) {
+            mean += errors[i] / errors.size();
+        }
+        printf("  %-15s mean %8.1f us, median %8.1f us, p99 %8.1f us, max %8.1f us late\n", names[method], mean,
+            errors[errors.size() / 2], errors[(size_t)(0.99 * (errors.size() - 1))], errors.back());
+    }
+}
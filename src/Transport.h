@@ -0,0 +1,125 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include "visa.h"
+
+/*
+    Error handling of the serial link to a power supply.
+    Failed writes are classified by their VISA status code to decide whether to retry the write,
+    reopen the session, or give up. After a reconnect the supply may have lost its settings
+    (e.g. after a brown-out), so the last known state is replayed from a shadow model first.
+*/
+
+// What to do about a failed VISA call.
+enum class ErrorClass {
+    None,           // success or warning
+    Timeout,        // the device did not respond in time; retry, then reconnect
+    Transient,      // corrupted or busy link; retry the write
+    ConnectionLost, // the session is gone; reconnect before retrying
+    Fatal           // retrying cannot help, e.g. an invalid command or parameter
+};
+
+inline ErrorClass classifyStatus(ViStatus status) {
+    if (status >= VI_SUCCESS) {
+        return ErrorClass::None;
+    }
+    switch (status) {
+    case VI_ERROR_TMO:
+        return ErrorClass::Timeout;
+    case VI_ERROR_IO:
+    case VI_ERROR_ASRL_PARITY:
+    case VI_ERROR_ASRL_FRAMING:
+    case VI_ERROR_ASRL_OVERRUN:
+    case VI_ERROR_RSRC_BUSY:
+    case VI_ERROR_RSRC_LOCKED:
+    case VI_ERROR_OUTP_PROT_VIOL:
+    case VI_ERROR_INP_PROT_VIOL:
+    case VI_ERROR_RAW_WR_PROT_VIOL:
+        return ErrorClass::Transient;
+    case VI_ERROR_CONN_LOST:
+    case VI_ERROR_INV_OBJECT:
+    case VI_ERROR_RSRC_NFOUND:
+    case VI_ERROR_SYSTEM_ERROR:
+    case VI_ERROR_CLOSING_FAILED:
+        return ErrorClass::ConnectionLost;
+    default:
+        return ErrorClass::Fatal;
+    }
+}
+
+inline const char* errorClassName(ErrorClass errorClass) {
+    switch (errorClass) {
+    case ErrorClass::None:
+        return "none";
+    case ErrorClass::Timeout:
+        return "timeout";
+    case ErrorClass::Transient:
+        return "transient";
+    case ErrorClass::ConnectionLost:
+        return "connection lost";
+    default:
+        return "fatal";
+    }
+}
+
+// Bounded exponential backoff between attempts.
+struct RetryPolicy {
+    int maxAttempts = 8;
+    int initialBackoffMs = 20;
+    int maxBackoffMs = 1000;
+    int maxTotalMs = 2000; // no retry starts later than this after the failure
+
+    // Delay before the given retry, starting at 1.
+    int backoffMs(int attempt) const {
+        int delay = initialBackoffMs;
+        for (int i = 1; i < attempt && delay < maxBackoffMs; i++) {
+            delay *= 2;
+        }
+        return delay < maxBackoffMs ? delay : maxBackoffMs;
+    }
+};
+
+// Last state sent to a power supply, replayed after a reconnect.
+struct ShadowState {
+    bool output = false;
+    bool listMode = false;
+    float voltageLimit = 0;
+    float current = 0;
+    // Active list, or the list memory slot it was recalled from (0 if uploaded)
+    std::vector<float> list;
+    float dwell = 0;
+    int count = 0;
+    int slot = 0;
+};
+
+// Failures and recoveries of one power supply.
+struct RecoveryStats {
+    int failures = 0;
+    int retries = 0;
+    int reconnects = 0;
+    int recovered = 0;
+    int unrecovered = 0;
+    double lastRecoveryMs = 0;
+    double maxRecoveryMs = 0;
+    double totalRecoveryMs = 0;
+
+    void recordRecovery(double ms) {
+        recovered++;
+        lastRecoveryMs = ms;
+        totalRecoveryMs += ms;
+        if (ms > maxRecoveryMs) {
+            maxRecoveryMs = ms;
+        }
+    }
+
+    void report(const std::string& name) const {
+        std::cout << name << ": " << failures << " failures, " << retries << " retries, " << reconnects
+            << " reconnects, " << recovered << " recovered, " << unrecovered << " unrecovered";
+        if (recovered > 0) {
+            std::cout << ", recovery time mean " << totalRecoveryMs / recovered << " ms, max " << maxRecoveryMs << " ms";
+        }
+        std::cout << "\n";
+    }
+};
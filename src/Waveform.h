@@ -0,0 +1,329 @@
+#pragma once
+
+#include <stdio.h>
+#include <math.h>
+#include <chrono>
+#include <vector>
+#include <iostream>
+#include "Arena.h"
+
+#if defined(_M_X64) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define WAVEFORM_SSE 1
+#endif
+
+/*
+    Generation of current waveforms for the three coils from segments: sinusoids, linear ramps,
+    holds and cubic Bezier paths. A segment gives all three axes at once, so a rotation is one
+    sinusoid with the y phase a quarter turn behind x.
+    The samples are written structure-of-arrays, one array per axis, into an Arena, and are
+    computed four at a time with SSE2: the cosine is a polynomial of the angle from the nearest
+    quarter turn, within 1e-6 of the amplitude, far below one step of the DAC. Angles are counted
+    in quarter turns, so the quarter points of a sinusoid come out exactly 0 or +-amplitude. Without
+    SSE2, and for the last samples of a segment, the same polynomial runs one sample at a time, so
+    every sample comes out the same wherever it falls.
+    Sample i of a segment of n samples is taken at t = i / n: the end point of a segment is the
+    first sample of the next one, and a sinusoid of whole cycles repeats without a seam.
+    benchmarkWaveforms() compares the generator with the scalar libm loops it replaces.
+*/
+
+#define WAVEFORM_TWO_PI 6.28318530717958647692
+
+enum class SegmentType {
+    Sinusoid, // offset + amplitude * cos(2 pi (cycles t + phase)) on each axis
+    Ramp,     // from `start` to `end`
+    Hold,     // `start`
+    Bezier    // cubic through `start`, `control[0]`, `control[1]`, `end`
+};
+
+struct WaveformSegment {
+    SegmentType type = SegmentType::Hold;
+    int samples = 0;
+    float start[3] = {};      // ramp start, hold value, Bezier first point, sinusoid offset
+    float end[3] = {};        // ramp end, Bezier last point, sinusoid amplitude
+    float control[2][3] = {}; // Bezier control points
+    float phase[3] = {};      // sinusoid phase of each axis in turns
+    float cycles = 1;         // sinusoid periods over the segment
+};
+
+inline WaveformSegment sinusoidSegment(int samples, const float offset[3], const float amplitude[3], const float phase[3],
+    float cycles) {
+    WaveformSegment segment;
+    segment.type = SegmentType::Sinusoid;
+    segment.samples = samples;
+    segment.cycles = cycles;
+    for (int a = 0; a < 3; a++) {
+        segment.start[a] = offset[a];
+        segment.end[a] = amplitude[a];
+        segment.phase[a] = phase[a];
+    }
+    return segment;
+}
+
+inline WaveformSegment rampSegment(int samples, const float from[3], const float to[3]) {
+    WaveformSegment segment;
+    segment.type = SegmentType::Ramp;
+    segment.samples = samples;
+    for (int a = 0; a < 3; a++) {
+        segment.start[a] = from[a];
+        segment.end[a] = to[a];
+    }
+    return segment;
+}
+
+inline WaveformSegment holdSegment(int samples, const float value[3]) {
+    WaveformSegment segment;
+    segment.type = SegmentType::Hold;
+    segment.samples = samples;
+    for (int a = 0; a < 3; a++) {
+        segment.start[a] = value[a];
+    }
+    return segment;
+}
+
+inline WaveformSegment bezierSegment(int samples, const float from[3], const float control1[3], const float control2[3],
+    const float to[3]) {
+    WaveformSegment segment;
+    segment.type = SegmentType::Bezier;
+    segment.samples = samples;
+    for (int a = 0; a < 3; a++) {
+        segment.start[a] = from[a];
+        segment.control[0][a] = control1[a];
+        segment.control[1][a] = control2[a];
+        segment.end[a] = to[a];
+    }
+    return segment;
+}
+
+// Samples of a waveform, one array per axis, owned by the arena they were generated into.
+// The arrays have room for a multiple of four samples.
+struct WaveformSamples {
+    float* axes[3] = {};
+    int samples = 0;
+};
+
+// Minimax polynomials of sin and cos on [-pi / 4, pi / 4]
+#define WAVEFORM_PI_OVER_2 1.57079632679489661923f
+#define WAVEFORM_SIN_1 -1.6666654611e-1f
+#define WAVEFORM_SIN_2 8.3321608736e-3f
+#define WAVEFORM_SIN_3 -1.9515295891e-4f
+#define WAVEFORM_COS_1 4.166664568298827e-2f
+#define WAVEFORM_COS_2 -1.388731625493765e-3f
+#define WAVEFORM_COS_3 2.443315711809948e-5f
+
+// Cosine of an angle of `quarters` quarter turns, with the polynomial of the SIMD path.
+inline float waveformCos(float quarters) {
+    int quadrant = (int)floorf(quarters + 0.5f);
+    float r = (quarters - quadrant) * WAVEFORM_PI_OVER_2;
+    float r2 = r * r;
+    float sine = r + r * r2 * (WAVEFORM_SIN_1 + r2 * (WAVEFORM_SIN_2 + r2 * WAVEFORM_SIN_3));
+    float cosine = 1 - 0.5f * r2 + r2 * r2 * (WAVEFORM_COS_1 + r2 * (WAVEFORM_COS_2 + r2 * WAVEFORM_COS_3));
+    // cos in quadrants 0 to 3 is cos r, -sin r, -cos r, sin r
+    float value = (quadrant & 1) ? sine : cosine;
+    return ((quadrant + 1) & 2) ? -value : value;
+}
+
+// Angle of sample i of a sinusoid in quarter turns. Whole turns are dropped, so the angle stays
+// small however many cycles a segment has.
+inline float waveformQuarters(const WaveformSegment& segment, int axis, int i) {
+    float turns = (float)i * segment.cycles / segment.samples + segment.phase[axis];
+    return (turns - (float)(int)turns) * 4;
+}
+
+// Value of `segment` on `axis` at sample i.
+inline float segmentSample(const WaveformSegment& segment, int axis, int i) {
+    float t = (float)i / segment.samples;
+    switch (segment.type) {
+    case SegmentType::Sinusoid:
+        return segment.start[axis] + segment.end[axis] * waveformCos(waveformQuarters(segment, axis, i));
+    case SegmentType::Ramp:
+        return segment.start[axis] + (segment.end[axis] - segment.start[axis]) * t;
+    case SegmentType::Bezier: {
+        float u = 1 - t;
+        return u * u * u * segment.start[axis] + 3 * (u * u * t) * segment.control[0][axis]
+            + 3 * (u * t * t) * segment.control[1][axis] + t * t * t * segment.end[axis];
+    }
+    default:
+        return segment.start[axis];
+    }
+}
+
+#ifdef WAVEFORM_SSE
+// floor of four floats of magnitude below 2^31, with SSE2 only.
+inline __m128 waveformFloor4(__m128 x) {
+    __m128 truncated = _mm_cvtepi32_ps(_mm_cvttps_epi32(x));
+    return _mm_sub_ps(truncated, _mm_and_ps(_mm_cmpgt_ps(truncated, x), _mm_set1_ps(1)));
+}
+
+// Cosines of four angles in quarter turns, like waveformCos().
+inline __m128 waveformCos4(__m128 quarters) {
+    __m128i quadrant = _mm_cvttps_epi32(waveformFloor4(_mm_add_ps(quarters, _mm_set1_ps(0.5f))));
+    __m128 r = _mm_mul_ps(_mm_sub_ps(quarters, _mm_cvtepi32_ps(quadrant)), _mm_set1_ps(WAVEFORM_PI_OVER_2));
+    __m128 r2 = _mm_mul_ps(r, r);
+    __m128 sine = _mm_add_ps(_mm_set1_ps(WAVEFORM_SIN_2), _mm_mul_ps(r2, _mm_set1_ps(WAVEFORM_SIN_3)));
+    sine = _mm_add_ps(_mm_set1_ps(WAVEFORM_SIN_1), _mm_mul_ps(r2, sine));
+    sine = _mm_add_ps(r, _mm_mul_ps(_mm_mul_ps(r, r2), sine));
+    __m128 cosine = _mm_add_ps(_mm_set1_ps(WAVEFORM_COS_2), _mm_mul_ps(r2, _mm_set1_ps(WAVEFORM_COS_3)));
+    cosine = _mm_add_ps(_mm_set1_ps(WAVEFORM_COS_1), _mm_mul_ps(r2, cosine));
+    cosine = _mm_add_ps(_mm_sub_ps(_mm_set1_ps(1), _mm_mul_ps(_mm_set1_ps(0.5f), r2)),
+        _mm_mul_ps(_mm_mul_ps(r2, r2), cosine));
+    __m128 odd = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(quadrant, _mm_set1_epi32(1)), _mm_set1_epi32(1)));
+    __m128 value = _mm_or_ps(_mm_and_ps(odd, sine), _mm_andnot_ps(odd, cosine));
+    __m128i sign = _mm_slli_epi32(_mm_and_si128(_mm_add_epi32(quadrant, _mm_set1_epi32(1)), _mm_set1_epi32(2)), 30);
+    return _mm_xor_ps(value, _mm_castsi128_ps(sign));
+}
+
+// Samples i to i + 3 of `segment` on `axis`.
+inline __m128 segmentSample4(const WaveformSegment& segment, int axis, int i) {
+    __m128 index = _mm_cvtepi32_ps(_mm_add_epi32(_mm_set1_epi32(i), _mm_set_epi32(3, 2, 1, 0)));
+    __m128 samples = _mm_set1_ps((float)segment.samples);
+    __m128 t = _mm_div_ps(index, samples);
+    __m128 start = _mm_set1_ps(segment.start[axis]);
+    __m128 end = _mm_set1_ps(segment.end[axis]);
+    switch (segment.type) {
+    case SegmentType::Sinusoid: {
+        __m128 turns = _mm_add_ps(_mm_div_ps(_mm_mul_ps(index, _mm_set1_ps(segment.cycles)), samples),
+            _mm_set1_ps(segment.phase[axis]));
+        turns = _mm_sub_ps(turns, _mm_cvtepi32_ps(_mm_cvttps_epi32(turns)));
+        return _mm_add_ps(start, _mm_mul_ps(end, waveformCos4(_mm_mul_ps(turns, _mm_set1_ps(4)))));
+    }
+    case SegmentType::Ramp:
+        return _mm_add_ps(start, _mm_mul_ps(_mm_sub_ps(end, start), t));
+    case SegmentType::Bezier: {
+        __m128 u = _mm_sub_ps(_mm_set1_ps(1), t);
+        __m128 three = _mm_set1_ps(3);
+        __m128 value = _mm_mul_ps(_mm_mul_ps(_mm_mul_ps(u, u), u), start);
+        value = _mm_add_ps(value, _mm_mul_ps(_mm_mul_ps(three, _mm_mul_ps(_mm_mul_ps(u, u), t)),
+            _mm_set1_ps(segment.control[0][axis])));
+        value = _mm_add_ps(value, _mm_mul_ps(_mm_mul_ps(three, _mm_mul_ps(_mm_mul_ps(u, t), t)),
+            _mm_set1_ps(segment.control[1][axis])));
+        return _mm_add_ps(value, _mm_mul_ps(_mm_mul_ps(_mm_mul_ps(t, t), t), end));
+    }
+    default:
+        return start;
+    }
+}
+#endif
+
+// Samples of `segments` one after the other, into arrays allocated from `arena`.
+inline WaveformSamples generateWaveform(const std::vector<WaveformSegment>& segments, Arena* arena) {
+    WaveformSamples waveform;
+    for (size_t s = 0; s < segments.size(); s++) {
+        waveform.samples += segments[s].samples > 0 ? segments[s].samples : 0;
+    }
+    int padded = (waveform.samples + 3) & ~3;
+    for (int a = 0; a < 3; a++) {
+        waveform.axes[a] = arena->allocate<float>(padded);
+    }
+    int position = 0;
+    for (size_t s = 0; s < segments.size(); s++) {
+        const WaveformSegment& segment = segments[s];
+        for (int a = 0; a < 3; a++) {
+            float* out = waveform.axes[a] + position;
+            int i = 0;
+#ifdef WAVEFORM_SSE
+            for (; i + 4 <= segment.samples; i += 4) {
+                _mm_storeu_ps(out + i, segmentSample4(segment, a, i));
+            }
+#endif
+            for (; i < segment.samples; i++) {
+                out[i] = segmentSample(segment, a, i);
+            }
+        }
+        position += segment.samples > 0 ? segment.samples : 0;
+    }
+    return waveform;
+}
+
+// The same samples with libm, one at a time, as the lookup tables were filled before the generator.
+inline void generateWaveformScalar(const std::vector<WaveformSegment>& segments, std::vector<float> axes[3]) {
+    for (int a = 0; a < 3; a++) {
+        axes[a].clear();
+    }
+    for (size_t s = 0; s < segments.size(); s++) {
+        const WaveformSegment& segment = segments[s];
+        for (int i = 0; i < segment.samples; i++) {
+            double t = (double)i / segment.samples;
+            for (int a = 0; a < 3; a++) {
+                double value;
+                if (segment.type == SegmentType::Sinusoid) {
+                    value = segment.start[a] + segment.end[a] * cos(WAVEFORM_TWO_PI * (segment.cycles * t + segment.phase[a]));
+                }
+                else if (segment.type == SegmentType::Ramp) {
+                    value = segment.start[a] + (segment.end[a] - segment.start[a]) * t;
+                }
+                else if (segment.type == SegmentType::Bezier) {
+                    double u = 1 - t;
+                    value = u * u * u * segment.start[a] + 3 * u * u * t * segment.control[0][a]
+                        + 3 * u * t * t * segment.control[1][a] + t * t * t * segment.end[a];
+                }
+                else {
+                    value = segment.start[a];
+                }
+                axes[a].push_back((float)value);
+            }
+        }
+    }
+}
+
+// Generate a waveform of about `points` samples per axis, a mix of all segment types, `repeats` times
+// with the generator and with the scalar loops, and print the samples per second of both and the
+// largest difference between them.
+inline void benchmarkWaveforms(int points, int repeats) {
+    float zero[3] = { 0, 0, 0 };
+    float amplitude[3] = { 2, 2, 1 };
+    float phase[3] = { 0, -0.25f, 0 };
+    float high[3] = { 1.5f, -1.5f, 1 };
+    float control1[3] = { 2, 0, -1 };
+    float control2[3] = { 0, 2, 0.5f };
+    int quarter = points / 4 > 1 ? points / 4 : 1;
+    std::vector<WaveformSegment> segments;
+    segments.push_back(sinusoidSegment(quarter, zero, amplitude, phase, 5));
+    segments.push_back(rampSegment(quarter, zero, high));
+    segments.push_back(holdSegment(quarter, high));
+    segments.push_back(bezierSegment(quarter, high, control1, control2, zero));
+    int samples = quarter * 4;
+
+    Arena arena;
+    WaveformSamples waveform;
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    for (int r = 0; r < repeats; r++) {
+        arena.reset();
+        waveform = generateWaveform(segments, &arena);
+    }
+    double simdSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+    std::vector<float> scalar[3];
+    begin = std::chrono::steady_clock::now();
+    for (int r = 0; r < repeats; r++) {
+        generateWaveformScalar(segments, scalar);
+    }
+    double scalarSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+    float maxError = 0;
+    for (int a = 0; a < 3; a++) {
+        for (int i = 0; i < samples; i++) {
+            float error = fabsf(waveform.axes[a][i] - scalar[a][i]);
+            maxError = error > maxError ? error : maxError;
+        }
+    }
+    double generated = 3.0 * samples * repeats;
+#ifdef WAVEFORM_SSE
+    const char* path = "SSE2";
+#else
+    const char* path = "scalar polynomial";
+#endif
+    printf("Waveform of %d samples on 3 axes, %d times\n", samples, repeats);
+    printf("  generator (%s): %.1f M samples/s\n", path, generated / simdSeconds / 1e6);
+    printf("  libm loops:        %.1f M samples/s\n", generated / scalarSeconds / 1e6);
+    printf("  %.1fx faster, largest difference %.2e A, arena %zu bytes\n", scalarSeconds / simdSeconds, maxError,
+        arena.bytesReserved());
+}
+
+// One turn of the field in `steps` samples with `amplitude` amps: cosines on x, sines on y, 0 on z.
+inline WaveformSamples rotationWaveform(int steps, float amplitude, Arena* arena) {
+    float offset[3] = { 0, 0, 0 };
+    float amplitudes[3] = { amplitude, amplitude, 0 };
+    float phase[3] = { 0, -0.25f, 0 };
+    return generateWaveform(std::vector<WaveformSegment>(1, sinusoidSegment(steps, offset, amplitudes, phase, 1)), arena);
+}